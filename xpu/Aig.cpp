@@ -0,0 +1,544 @@
+#include "Aig.h"
+#include <iostream>
+#include <algorithm>
+
+AigGraph::AigGraph(const UnitBuilder &builder)
+{
+    std::vector<AigNode> old;
+    reset(old);
+
+    int length = builder.count32();
+    if (length > INT32_MAX / 2)
+        throw "Out of gates"; // Literals take one more bit
+    std::vector<int> lit(length);
+    for (int i = 0; i < length; ++i) {
+        auto &g = builder.gate(i);
+        int a = g.pin1 >= 0 ? lit[g.pin1] : -1;
+        int b = g.pin2 >= 0 ? lit[g.pin2] : -1;
+        switch (g.opcode) {
+        case GateOpcode::Zero:
+            lit[i] = 0;
+            break;
+        case GateOpcode::One:
+            lit[i] = 1;
+            break;
+        case GateOpcode::And:
+            lit[i] = andLit(a, b);
+            break;
+        case GateOpcode::Nand:
+            lit[i] = andLit(a, b) ^ 1;
+            break;
+        case GateOpcode::Or:
+            lit[i] = andLit(a ^ 1, b ^ 1) ^ 1;
+            break;
+        case GateOpcode::Nor:
+            lit[i] = andLit(a ^ 1, b ^ 1);
+            break;
+        case GateOpcode::Xor:
+            lit[i] = xorLit(a, b);
+            break;
+        case GateOpcode::Not:
+            lit[i] = a ^ 1;
+            break;
+        default: {
+            // Mux, Maj3 and Lut4 would take several ANDs that apply()
+            // can't map back, they stay whole like the stateful gates
+            AigNode box;
+            box.opcode = g.opcode;
+            box.table = g.table;
+            box.value = g.value;
+            box.lanes = g.lanes;
+            int c = g.pin3 >= 0 ? lit[g.pin3] : -1;
+            int d = g.pin4 >= 0 ? lit[g.pin4] : -1;
+            lit[i] = addBox(box, a, b, c, d) * 2;
+            break;
+        }
+        }
+    }
+
+    for (auto &pr : builder.namedVectors()) {
+        auto &vc = pr.second;
+        std::vector<int> lits(vc.length, -1);
+        for (int i = 0; i < vc.length; ++i) {
+            if (vc[i] >= 0)
+                lits[i] = lit[vc[i]];
+        }
+        outputs.insert(std::make_pair(pr.first, lits));
+    }
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+// First slot holding the same AND, or the empty slot ending the probe
+size_t AigGraph::hashSlot(int lit0, int lit1) const
+{
+    uint64_t h = (uint64_t)(uint32_t)lit0 * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)(uint32_t)lit1 * 0xC2B2AE3D27D4EB4FULL;
+    h ^= h >> 29;
+    size_t mask = hashSlots.size() - 1;
+    for (size_t k = h & mask; ; k = (k + 1) & mask) {
+        int idx = hashSlots[k];
+        if (idx < 0)
+            return k;
+        if (nodes[idx].lit0 == lit0 && nodes[idx].lit1 == lit1)
+            return k;
+    }
+}
+
+int AigGraph::addNode(GateOpcode opcode, int lit0, int lit1)
+{
+    AigNode n;
+    n.opcode = opcode;
+    n.table = 0;
+    n.value = false;
+    n.lanes = 0;
+    return addBox(n, lit0, lit1, -1, -1);
+}
+
+// Opcode, table and state of box, pins and level from the literals
+int AigGraph::addBox(const AigNode &box, int lit0, int lit1, int lit2, int lit3)
+{
+    AigNode n = box;
+    n.lit0 = lit0;
+    n.lit1 = lit1;
+    n.lit2 = lit2;
+    n.lit3 = lit3;
+    n.level = 0;
+    for (int lit : { lit0, lit1, lit2, lit3 }) {
+        if (lit >= 0)
+            n.level = std::max(n.level, levelOf(lit) + 1);
+    }
+    nodes.push_back(n);
+    return (int)nodes.size() - 1;
+}
+
+int AigGraph::andLit(int a, int b)
+{
+    if (a > b)
+        std::swap(a, b);
+    if (a == 0 || (a ^ 1) == b)
+        return 0;
+    if (a == 1 || a == b)
+        return b;
+
+    // Two-level rules, one operand is an AND node
+    for (int pass = 0; pass < 2; ++pass) {
+        int x = pass ? b : a;
+        int y = pass ? a : b;
+        const AigNode n = nodes[x >> 1];
+        if (n.opcode != GateOpcode::And)
+            continue;
+        if ((x & 1) == 0) {
+            if (y == (n.lit0 ^ 1) || y == (n.lit1 ^ 1))
+                return 0; // Contradiction
+            if (y == n.lit0 || y == n.lit1)
+                return x; // Idempotence
+        } else {
+            if (y == (n.lit0 ^ 1) || y == (n.lit1 ^ 1))
+                return y; // Subsumption
+            if (y == n.lit0)
+                return andLit(n.lit1 ^ 1, y); // Substitution
+            if (y == n.lit1)
+                return andLit(n.lit0 ^ 1, y);
+        }
+    }
+    const AigNode na = nodes[a >> 1];
+    const AigNode nb = nodes[b >> 1];
+    if ((a & 1) == 0 && (b & 1) == 0 && na.opcode == GateOpcode::And && nb.opcode == GateOpcode::And) {
+        if (na.lit0 == (nb.lit0 ^ 1) || na.lit0 == (nb.lit1 ^ 1) ||
+            na.lit1 == (nb.lit0 ^ 1) || na.lit1 == (nb.lit1 ^ 1))
+            return 0; // Contradiction across both ANDs
+    }
+
+    if ((hashCount + 1) * 2 > (int)hashSlots.size()) {
+        hashSlots.assign(hashSlots.empty() ? 1024 : hashSlots.size() * 2, -1);
+        hashCount = 0;
+        for (int i = 1; i < (int)nodes.size(); ++i) {
+            if (nodes[i].opcode == GateOpcode::And) {
+                hashSlots[hashSlot(nodes[i].lit0, nodes[i].lit1)] = i;
+                hashCount++;
+            }
+        }
+    }
+    size_t k = hashSlot(a, b);
+    if (hashSlots[k] >= 0)
+        return hashSlots[k] * 2;
+    int idx = addNode(GateOpcode::And, a, b);
+    hashSlots[k] = idx;
+    hashCount++;
+    return idx * 2;
+}
+
+int AigGraph::xorLit(int a, int b)
+{
+    return andLit(andLit(a, b ^ 1) ^ 1, andLit(a ^ 1, b) ^ 1) ^ 1;
+}
+
+// Start an empty graph, the previous nodes are moved to old
+void AigGraph::reset(std::vector<AigNode> &old)
+{
+    old.swap(nodes);
+    nodes.clear();
+    hashSlots.clear();
+    hashCount = 0;
+    addNode(GateOpcode::Zero, -1, -1);
+}
+
+// Count the references of every node reachable from the outputs, 0 if dead
+void AigGraph::markLive(const std::vector<AigNode> &graph, std::vector<int> &refs) const
+{
+    refs.assign(graph.size(), 0);
+    for (auto &pr : outputs) {
+        for (int lit : pr.second) {
+            if (lit >= 0)
+                refs[lit >> 1]++;
+        }
+    }
+    for (int i = (int)graph.size(); i-- > 1; ) {
+        if (refs[i] == 0)
+            continue;
+        for (int lit : { graph[i].lit0, graph[i].lit1, graph[i].lit2, graph[i].lit3 }) {
+            if (lit >= 0)
+                refs[lit >> 1]++;
+        }
+    }
+}
+
+void AigGraph::remapOutputs(const std::vector<int> &map)
+{
+    for (auto &pr : outputs) {
+        for (int &lit : pr.second) {
+            if (lit >= 0)
+                lit = map[lit >> 1] ^ (lit & 1);
+        }
+    }
+}
+
+int AigGraph::size() const
+{
+    std::vector<int> refs;
+    markLive(nodes, refs);
+    int count = 0;
+    for (int i = 1; i < (int)nodes.size(); ++i) {
+        if (refs[i] && nodes[i].opcode == GateOpcode::And)
+            count++;
+    }
+    return count;
+}
+
+int AigGraph::depth() const
+{
+    std::vector<int> refs;
+    markLive(nodes, refs);
+    int level = 0;
+    for (int i = 1; i < (int)nodes.size(); ++i) {
+        if (refs[i])
+            level = std::max(level, nodes[i].level);
+    }
+    return level;
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+void AigGraph::rewrite()
+{
+    std::vector<AigNode> old;
+    reset(old);
+    std::vector<int> refs;
+    markLive(old, refs);
+
+    std::vector<int> map(old.size(), 0);
+    auto remap = [&](int lit) { return lit < 0 ? -1 : map[lit >> 1] ^ (lit & 1); };
+    for (int i = 1; i < (int)old.size(); ++i) {
+        auto &n = old[i];
+        if (refs[i] == 0)
+            continue;
+        if (n.opcode == GateOpcode::And)
+            map[i] = andLit(remap(n.lit0), remap(n.lit1));
+        else
+            map[i] = addBox(n, remap(n.lit0), remap(n.lit1), remap(n.lit2), remap(n.lit3)) * 2;
+    }
+    remapOutputs(map);
+}
+
+void AigGraph::balance()
+{
+    std::vector<AigNode> old;
+    reset(old);
+    std::vector<int> refs;
+    markLive(old, refs);
+
+    // A single fanout AND read without inversion by another AND is part of
+    // the reader's tree and isn't built on its own
+    std::vector<char> absorbed(old.size(), 0);
+    for (int i = 1; i < (int)old.size(); ++i) {
+        auto &n = old[i];
+        if (refs[i] == 0 || n.opcode != GateOpcode::And)
+            continue;
+        for (int lit : { n.lit0, n.lit1 }) {
+            if ((lit & 1) == 0 && refs[lit >> 1] == 1 && old[lit >> 1].opcode == GateOpcode::And)
+                absorbed[lit >> 1] = 1;
+        }
+    }
+
+    std::vector<int> map(old.size(), 0);
+    auto remap = [&](int lit) { return lit < 0 ? -1 : map[lit >> 1] ^ (lit & 1); };
+    std::vector<int> leaves;
+    std::vector<int> stack;
+    for (int i = 1; i < (int)old.size(); ++i) {
+        auto &n = old[i];
+        if (refs[i] == 0 || absorbed[i])
+            continue;
+        if (n.opcode != GateOpcode::And) {
+            map[i] = addBox(n, remap(n.lit0), remap(n.lit1), remap(n.lit2), remap(n.lit3)) * 2;
+            continue;
+        }
+
+        leaves.clear();
+        stack.assign({ n.lit0, n.lit1 });
+        while (!stack.empty()) {
+            int lit = stack.back();
+            stack.pop_back();
+            if (absorbed[lit >> 1] && (lit & 1) == 0) {
+                stack.push_back(old[lit >> 1].lit0);
+                stack.push_back(old[lit >> 1].lit1);
+            } else {
+                leaves.push_back(remap(lit));
+            }
+        }
+
+        std::sort(leaves.begin(), leaves.end());
+        leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+        bool zero = false;
+        for (int k = 0; k + 1 < (int)leaves.size(); ++k) {
+            if ((leaves[k] ^ 1) == leaves[k + 1])
+                zero = true;
+        }
+        if (zero || (!leaves.empty() && leaves[0] == 0)) {
+            map[i] = 0;
+            continue;
+        }
+
+        // Pair the two shallowest operands until one is left
+        std::sort(leaves.begin(), leaves.end(), [&](int x, int y) { return levelOf(x) > levelOf(y); });
+        while (leaves.size() > 1) {
+            int x = leaves.back();
+            leaves.pop_back();
+            int y = leaves.back();
+            leaves.pop_back();
+            int lit = andLit(x, y);
+            auto at = std::upper_bound(leaves.begin(), leaves.end(), lit,
+                [&](int v, int e) { return levelOf(v) > levelOf(e); });
+            leaves.insert(at, lit);
+        }
+        map[i] = leaves[0];
+    }
+    remapOutputs(map);
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+void AigGraph::apply(UnitBuilder &builder) const
+{
+    int count = (int)nodes.size();
+
+    // AND(!AND(a, b), !AND(!a, !b)) is a XOR of a and b
+    std::vector<int> xorA(count, -1);
+    std::vector<int> xorB(count, -1);
+    std::vector<char> xorInv(count, 0);
+    for (int i = 1; i < count; ++i) {
+        auto &n = nodes[i];
+        if (n.opcode != GateOpcode::And || (n.lit0 & 1) == 0 || (n.lit1 & 1) == 0)
+            continue;
+        auto &p = nodes[n.lit0 >> 1];
+        auto &q = nodes[n.lit1 >> 1];
+        if (p.opcode != GateOpcode::And || q.opcode != GateOpcode::And)
+            continue;
+        if (p.lit0 != (q.lit0 ^ 1) || p.lit1 != (q.lit1 ^ 1))
+            continue;
+        xorA[i] = p.lit0 & ~1;
+        xorB[i] = p.lit1 & ~1;
+        xorInv[i] = ((p.lit0 ^ p.lit1) & 1) != 0;
+    }
+
+    // Pick the gate of each node walking back from the outputs, all its
+    // readers are known by then. A gate can read both inputs inverted (Nor
+    // and Or instead of And and Nand), the form that reuses polarities
+    // already needed is taken so fewer gates are doubled. Readers placed
+    // before their input can't see all its needs, this stays a heuristic.
+    std::vector<int> uses(count * 2, 0);
+    std::vector<int> pinLit0(count, -1);
+    std::vector<int> pinLit1(count, -1);
+    std::vector<int> pinLit2(count, -1);
+    std::vector<int> pinLit3(count, -1);
+    std::vector<char> native(count, 0);
+    auto need = [&](int lit) {
+        if (lit >= 0)
+            uses[lit]++;
+    };
+    auto needed = [&](int i) { return uses[i * 2] || uses[i * 2 + 1]; };
+    auto cost = [&](int lit) {
+        if (uses[lit])
+            return 0;
+        if (nodes[lit >> 1].opcode != GateOpcode::And)
+            return (lit & 1) ? 4 : 0; // Inverted input or latch takes a Not
+        if (uses[lit ^ 1])
+            return 5;
+        return (lit & 1) ? 3 : 2;
+    };
+    for (auto &pr : outputs) {
+        for (int lit : pr.second)
+            need(lit);
+    }
+    for (int i = count; i-- > 1; ) {
+        auto &n = nodes[i];
+        if (!needed(i))
+            continue;
+        int want = uses[i * 2] ? 0 : 1;
+        if (n.opcode != GateOpcode::And) {
+            pinLit0[i] = n.lit0;
+            pinLit1[i] = n.lit1;
+            pinLit2[i] = n.lit2;
+            pinLit3[i] = n.lit3;
+        } else if (xorA[i] >= 0) {
+            // Inverting one input inverts the result, take the cheapest
+            // pair giving the wanted polarity
+            int best = -1;
+            for (int k = 0; k < 4; ++k) {
+                int a = xorA[i] ^ (k & 1);
+                int b = xorB[i] ^ (k >> 1);
+                if (((k & 1) ^ (k >> 1) ^ xorInv[i]) != want)
+                    continue;
+                if (best < 0 || cost(a) + cost(b) < cost(pinLit0[i]) + cost(pinLit1[i])) {
+                    best = k;
+                    pinLit0[i] = a;
+                    pinLit1[i] = b;
+                }
+            }
+        } else {
+            int flip = cost(n.lit0 ^ 1) + cost(n.lit1 ^ 1) < cost(n.lit0) + cost(n.lit1) ? 1 : 0;
+            pinLit0[i] = n.lit0 ^ flip;
+            pinLit1[i] = n.lit1 ^ flip;
+        }
+        native[i] = want;
+        need(pinLit0[i]);
+        need(pinLit1[i]);
+        need(pinLit2[i]);
+        need(pinLit3[i]);
+    }
+
+    std::vector<LogicalGate> gates;
+    std::vector<int> gatePos(count, -1);
+    std::vector<int> gateNeg(count, -1);
+    auto emit = [&](GateOpcode opcode, int pin1, int pin2) {
+        LogicalGate g;
+        g.opcode = opcode;
+        g.pin1 = pin1;
+        g.pin2 = pin2;
+        g.pin3 = -1;
+        g.pin4 = -1;
+        g.table = 0;
+        g.value = false;
+        g.lanes = 0;
+        g.depth = 0;
+        g.usage = 0;
+        gates.push_back(g);
+        return (int)gates.size() - 1;
+    };
+    auto gateOf = [&](int lit) {
+        if (lit < 0)
+            return -1;
+        return (lit & 1) ? gateNeg[lit >> 1] : gatePos[lit >> 1];
+    };
+
+    if (uses[0])
+        gatePos[0] = emit(GateOpcode::Zero, -1, -1);
+    if (uses[1])
+        gateNeg[0] = emit(GateOpcode::One, -1, -1);
+    for (int i = 1; i < count; ++i) {
+        auto &n = nodes[i];
+        if (!needed(i))
+            continue;
+        if (n.opcode == GateOpcode::And && xorA[i] < 0 && !uses[i * 2 + native[i]])
+            native[i] ^= 1;
+        GateOpcode opcode = n.opcode;
+        if (xorA[i] >= 0)
+            opcode = GateOpcode::Xor;
+        else if (opcode == GateOpcode::And && pinLit0[i] != n.lit0)
+            opcode = native[i] ? GateOpcode::Or : GateOpcode::Nor;
+        else if (opcode == GateOpcode::And)
+            opcode = native[i] ? GateOpcode::Nand : GateOpcode::And;
+        int idx = emit(opcode, gateOf(pinLit0[i]), gateOf(pinLit1[i]));
+        if (n.opcode != GateOpcode::And) {
+            gates[idx].pin3 = gateOf(pinLit2[i]);
+            gates[idx].pin4 = gateOf(pinLit3[i]);
+            gates[idx].table = n.table;
+            gates[idx].value = n.value;
+            gates[idx].lanes = n.lanes;
+        }
+        (native[i] ? gateNeg : gatePos)[i] = idx;
+        if (!uses[i * 2 + !native[i]])
+            continue;
+        // Both polarities, an AND takes a second gate on the same inputs
+        // instead of a Not so it doesn't add a level
+        int other;
+        switch (opcode) {
+        case GateOpcode::And:
+            other = emit(GateOpcode::Nand, gates[idx].pin1, gates[idx].pin2);
+            break;
+        case GateOpcode::Nand:
+            other = emit(GateOpcode::And, gates[idx].pin1, gates[idx].pin2);
+            break;
+        case GateOpcode::Or:
+            other = emit(GateOpcode::Nor, gates[idx].pin1, gates[idx].pin2);
+            break;
+        case GateOpcode::Nor:
+            other = emit(GateOpcode::Or, gates[idx].pin1, gates[idx].pin2);
+            break;
+        default:
+            other = emit(GateOpcode::Not, idx, -1);
+            break;
+        }
+        (native[i] ? gatePos : gateNeg)[i] = other;
+    }
+
+    std::map<std::string, LogicalVector> named;
+    for (auto &pr : outputs) {
+        LogicalVector rs((int)pr.second.size());
+        for (int i = 0; i < (int)pr.second.size(); ++i) {
+            if (pr.second[i] >= 0)
+                rs.set(i, gateOf(pr.second[i]));
+        }
+        rs.pack();
+        named.insert(std::make_pair(pr.first, rs));
+    }
+    builder.rebuild(gates, named);
+}
+
+void AigGraph::optimize(UnitBuilder &builder)
+{
+    int before = builder.count32();
+    int depthBefore = builder.depth();
+    std::vector<LogicalGate> board;
+    for (int i = 0; i < before; ++i)
+        board.push_back(builder.gate(i));
+    std::map<std::string, LogicalVector> named = builder.namedVectors();
+
+    AigGraph aig(builder);
+    int andsBefore = aig.size();
+    int levelsBefore = aig.depth();
+    aig.rewrite();
+    aig.balance();
+    aig.rewrite();
+    aig.apply(builder);
+
+    std::cout << "AIG (" << before << " -> " << builder.count() << " gates, depth "
+        << depthBefore << " -> " << builder.depth() << ", " << andsBefore << " -> "
+        << aig.size() << " ands, " << levelsBefore << " -> " << aig.depth() << " levels)";
+    if (builder.count() >= before && builder.depth() >= depthBefore) {
+        // Nothing gained, keep the netlist we had
+        builder.rebuild(board, named);
+        std::cout << " kept";
+    }
+    std::cout << std::endl;
+}
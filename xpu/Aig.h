@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include "UnitBuilder.h"
+
+struct AigNode
+{
+public:
+    GateOpcode opcode; // And, or the gate kept as a box
+    int lit0;
+    int lit1;
+    int lit2; // Third and fourth pins of a box, -1 when unused
+    int lit3;
+    uint16_t table;
+    int level;
+    bool value;
+    uint64_t lanes;
+};
+
+// And-Inverter Graph of a UnitBuilder. Combinational gates become two input
+// ANDs with complemented edges, a literal is node * 2 + inverted and node 0
+// is the constant false. Inputs, stateful gates and the Mux, Maj3 and Lut4
+// cells are kept as boxes, they read literals and their output is a new
+// leaf.
+class AigGraph
+{
+private:
+    std::vector<AigNode> nodes;
+    std::map<std::string, std::vector<int>> outputs;
+    std::vector<int> hashSlots;
+    int hashCount;
+
+    size_t hashSlot(int lit0, int lit1) const;
+    int addNode(GateOpcode opcode, int lit0, int lit1);
+    int addBox(const AigNode &box, int lit0, int lit1, int lit2, int lit3);
+    int andLit(int a, int b);
+    int xorLit(int a, int b);
+    int levelOf(int lit) const { return nodes[lit >> 1].level; }
+    void reset(std::vector<AigNode> &old);
+    void markLive(const std::vector<AigNode> &graph, std::vector<int> &refs) const;
+    void remapOutputs(const std::vector<int> &map);
+public:
+    AigGraph(const UnitBuilder &builder);
+
+    // AND nodes and their longest path, inverters are free
+    int size() const;
+    int depth() const;
+
+    // Rebuild every node through the two-level simplification rules
+    void rewrite();
+    // Collapse single fanout AND trees and rebuild them shallowest first
+    void balance();
+    // Map back to GateOpcode gates, complemented pairs become Xor gates and
+    // inverted inputs Nor or Or gates when that saves a Not
+    void apply(UnitBuilder &builder) const;
+
+    // Convert, rewrite, balance and map back. Indices taken before must be
+    // looked up again.
+    static void optimize(UnitBuilder &builder);
+};
@@ -0,0 +1,408 @@
+#include "Checks.h"
+#include "UnitParser.h"
+#include "Netlist.h"
+#include "NetlistJit.h"
+#include <cstdlib>
+#include <random>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <string>
+#include <vector>
+
+// FNV-1a over the gates and the named vectors of a board
+static uint64_t boardHash(const UnitBuilder &builder)
+{
+    uint64_t h = 1469598103934665603ULL;
+    auto mix = [&](uint64_t v) { h = (h ^ v) * 1099511628211ULL; };
+    for (GateId i = 0; i < builder.count(); ++i) {
+        auto &g = builder.gate(i);
+        mix((uint64_t)g.opcode);
+        mix((uint64_t)g.pin1);
+        mix((uint64_t)g.pin2);
+        mix((uint64_t)g.pin3);
+        mix((uint64_t)g.pin4);
+        mix(g.table);
+    }
+    for (auto &pr : builder.namedVectors()) {
+        for (char c : pr.first)
+            mix((uint64_t)c);
+        for (int i = 0; i < pr.second.length; ++i)
+            mix((uint64_t)pr.second[i]);
+    }
+    return h;
+}
+
+// One input and a constant on each side of every two-input gate, the
+// outputs have to be the same once the constants are folded
+int checkOptimize()
+{
+    const GateOpcode ops[] = { GateOpcode::And, GateOpcode::Or, GateOpcode::Xor, GateOpcode::Nand, GateOpcode::Nor };
+    UnitBuilder builder;
+    LogicalVector in = builder.addInput("A", 2);
+    GateId zero = builder.addGate(GateOpcode::Zero);
+    GateId one = builder.addGate(GateOpcode::One);
+    std::vector<std::string> names;
+    for (auto op : ops) {
+        for (GateId k : { zero, one }) {
+            std::string name = "G" + std::to_string(names.size());
+            builder.addInput(name, LogicalVector(builder.addGate(op, in[0], k), 1));
+            names.push_back(name);
+            name = "G" + std::to_string(names.size());
+            builder.addInput(name, LogicalVector(builder.addGate(op, k, in[1]), 1));
+            names.push_back(name);
+        }
+    }
+
+    std::vector<bool> before;
+    for (int v = 0; v < 4; ++v) {
+        builder.set(in[0], v & 1);
+        builder.set(in[1], (v >> 1) & 1);
+        builder.tick();
+        for (auto &name : names)
+            before.push_back(builder.get(builder[name][0]));
+    }
+    try {
+        builder.optimize();
+    } catch (const char *err) {
+        std::cout << "optimize: " << err << std::endl;
+        return 1;
+    }
+    int errors = 0;
+    size_t k = 0;
+    in = builder["A"];
+    for (int v = 0; v < 4; ++v) {
+        builder.set(in[0], v & 1);
+        builder.set(in[1], (v >> 1) & 1);
+        builder.tick();
+        for (auto &name : names) {
+            if (builder.get(builder[name][0]) != before[k++])
+                errors++;
+        }
+    }
+    std::cout << "optimize: " << names.size() << " gates with a constant input, "
+        << errors << " mismatches" << std::endl;
+    return errors;
+}
+
+int checkEvents()
+{
+    const GateOpcode ops[] = { GateOpcode::And, GateOpcode::Or, GateOpcode::Xor };
+    UnitBuilder builder;
+    LogicalVector in(10);
+    GateId g = builder.addGate(GateOpcode::Fix);
+    in.set(0, g);
+    for (int i = 1; i < in.length; ++i) {
+        GateId x = builder.addGate(GateOpcode::Fix);
+        in.set(i, x);
+        g = builder.addGate(ops[i % 3], g, x);
+    }
+    builder.addInput("In", in);
+    builder.addInput("Out", LogicalVector(g, 1));
+
+    Netlist net(builder);
+    std::mt19937 rng(2);
+    int errors = 0;
+    for (int k = 0; k < 200; ++k) {
+        unsigned v = rng();
+        LogicalVector a = builder["In"];
+        LogicalVector b = net["In"];
+        for (int i = 0; i < in.length; ++i) {
+            builder.set(a[i], (v >> i) & 1);
+            net.set(b[i], (v >> i) & 1);
+        }
+        if (k == 1)
+            net.tickLevels(); // Renumbers the gates
+        builder.tick();
+        net.tickEvents();
+        if (builder.get(builder["Out"][0]) != net.get(net["Out"][0]))
+            errors++;
+    }
+    std::cout << "events: 200 vectors, " << errors << " mismatches" << std::endl;
+    return errors;
+}
+
+int checkProbes()
+{
+    UnitBuilder full;
+    UnitBuilder probed;
+    for (UnitBuilder *b : { &full, &probed }) {
+        LogicalVector d = b->addInput("D", 8);
+        LogicalVector clk = b->addInput("Clk", 1);
+        LogicalVector q = b->addReg(d, clk);
+        LogicalVector x(8), y(8);
+        for (int i = 0; i < 8; ++i) {
+            x.set(i, b->addGate(GateOpcode::Xor, q[i], d[i]));
+            y.set(i, b->addGate(GateOpcode::And, d[i], d[(i + 1) % 8]));
+        }
+        b->addInput("X", x);
+        b->addInput("Y", y);
+    }
+    probed.setProbes({ probed["Y"] });
+
+    std::mt19937 rng(3);
+    int errors = 0;
+    for (int k = 0; k < 200; ++k) {
+        unsigned v = rng();
+        for (UnitBuilder *b : { &full, &probed }) {
+            b->setU8((*b)["D"], v & 0xff);
+            b->set((*b)["Clk"][0], k & 1);
+            b->tick();
+        }
+        // X is read after the tick, the first read pulls it into the cone
+        for (int i = 0; i < 8; ++i) {
+            if (full.get(full["X"][i]) != probed.get(probed["X"][i]))
+                errors++;
+            if (full.get(full["Y"][i]) != probed.get(probed["Y"][i]))
+                errors++;
+        }
+        if (k == 100)
+            probed.setProbes({ probed["Y"] });
+    }
+    std::cout << "probes: 200 ticks on a register, " << errors << " mismatches" << std::endl;
+    return errors;
+}
+
+int checkSettle()
+{
+    UnitBuilder latch;
+    LogicalVector s = latch.addInput("S", 1);
+    LogicalVector r = latch.addInput("R", 1);
+    GateId q = latch.addGate(GateOpcode::Nor, r[0], r[0]);
+    GateId qb = latch.addGate(GateOpcode::Nor, s[0], q);
+    Netlist net(latch);
+    net.connect(q, 2, qb);
+
+    // S, R and the expected Q
+    const int steps[][3] = { { 1, 0, 1 }, { 0, 0, 1 }, { 0, 1, 0 }, { 0, 0, 0 }, { 1, 0, 1 } };
+    int errors = 0;
+    int total = 0;
+    for (auto &st : steps) {
+        net.set(s[0], st[0] != 0);
+        net.set(r[0], st[1] != 0);
+        int sweeps = net.settle(16);
+        if (sweeps < 0 || net.get(q) != (st[2] != 0) || net.get(qb) == (st[2] != 0))
+            errors++;
+        total += sweeps;
+    }
+
+    UnitBuilder ring;
+    LogicalVector in = ring.addInput("In", 1);
+    GateId a = ring.addGate(GateOpcode::Not, in[0]);
+    GateId b = ring.addGate(GateOpcode::Not, a);
+    GateId c = ring.addGate(GateOpcode::Not, b);
+    Netlist osc(ring);
+    osc.connect(a, 1, c);
+    int cycles = osc.settle(16);
+    if (cycles != -1)
+        errors++;
+    std::cout << "settle: NOR latch in " << total << " sweeps over 5 inputs, ring of inverters "
+        << cycles << ", " << errors << " mismatches" << std::endl;
+    return errors;
+}
+
+int checkJit(const char *path)
+{
+    UnitParser p(path);
+    try {
+        p.elaborate();
+    } catch (const char *err) {
+        auto at = p.where();
+        std::cout << (at.empty() ? std::string(path) : at) << ": " << err << std::endl;
+        return 1;
+    }
+    UnitBuilder &builder = p.unit();
+    NetlistJit jit(builder);
+    NetlistJit interpreter(builder);
+    std::mt19937_64 rng(1);
+    int errors = 0;
+    for (int r = 0; r < 8; ++r) {
+        for (GateId i = 0; i < builder.count(); ++i) {
+            GateOpcode op = builder.gate(i).opcode;
+            if (op != GateOpcode::Fix && op != GateOpcode::Clk)
+                continue;
+            uint64_t lanes = rng();
+            builder.setLanes(i, lanes);
+            jit.setLanes(i, lanes);
+            interpreter.setLanes(i, lanes);
+        }
+        builder.tickLanes();
+        jit.tick();
+        interpreter.tickInterpreted();
+        for (GateId i = 0; i < builder.count(); ++i) {
+            uint64_t lanes = builder.getLanes(i);
+            errors += jit.getLanes(i) != lanes;
+            errors += interpreter.getLanes(i) != lanes;
+        }
+    }
+    errors += jit.compare(builder, 2);
+    std::cout << "jit " << path << ": " << builder.count() << " gates, "
+        << (jit.compiled() ? "native" : "interpreted") << ", " << errors << " mismatches" << std::endl;
+    return errors;
+}
+
+int checkParallel(int gates, int threads)
+{
+    const GateOpcode ops[] = { GateOpcode::And, GateOpcode::Or, GateOpcode::Xor, GateOpcode::Nand, GateOpcode::Nor };
+    const int inputs = 4096;
+    UnitBuilder builder(gates + 1);
+    builder.addInput("In", inputs);
+    std::mt19937 rng(1);
+    while (builder.count() < gates) {
+        GateId lo = builder.count() > 16384 ? builder.count() - 16384 : 0;
+        GateId span = builder.count() - lo;
+        builder.addGate(ops[rng() % 5], lo + rng() % span, lo + rng() % span);
+    }
+    builder.addInput("Out", LogicalVector(gates - inputs, inputs));
+
+    // Small chunks so that every level is split across the threads
+    const int grain = 256;
+    Netlist levels(builder);
+    Netlist parallel(builder);
+    levels.levelize();
+    parallel.levelize();
+    int errors = 0;
+    {
+        ThreadPool pool(threads);
+        for (int r = 0; r < 8; ++r) {
+            LogicalVector in = builder["In"];
+            LogicalVector a = levels["In"];
+            LogicalVector b = parallel["In"];
+            for (int i = 0; i < inputs; ++i) {
+                bool value = rng() & 1;
+                builder.set(in[i], value);
+                levels.set(a[i], value);
+                parallel.set(b[i], value);
+            }
+            builder.tick();
+            levels.tickLevels();
+            parallel.tickParallel(pool, grain);
+            for (int i = 0; i < parallel.size(); ++i)
+                errors += parallel.get(i) != levels.get(i);
+            LogicalVector out = builder["Out"];
+            LogicalVector c = parallel["Out"];
+            for (int i = 0; i < inputs; ++i)
+                errors += parallel.get(c[i]) != builder.get(out[i]);
+        }
+    }
+    std::cout << "parallel: " << gates << " gates, depth " << parallel.depth() << ", "
+        << errors << " mismatches" << std::endl;
+
+    // RS gates with both inputs set draw from rand(), the same seed has to
+    // give the same values as tickLevels()
+    {
+        UnitBuilder latches(1 << 16);
+        latches.addInput("In", 1024);
+        while (latches.count() < 1 << 16) {
+            GateId lo = latches.count() > 4096 ? latches.count() - 4096 : 0;
+            GateId span = latches.count() - lo;
+            GateOpcode op = rng() % 8 ? ops[rng() % 5] : GateOpcode::RS;
+            latches.addGate(op, lo + rng() % span, lo + rng() % span);
+        }
+        Netlist a(latches);
+        Netlist b(latches);
+        a.levelize();
+        b.levelize();
+        ThreadPool pool(threads);
+        int unstable = 0;
+        for (int r = 0; r < 8; ++r) {
+            LogicalVector ia = a["In"];
+            LogicalVector ib = b["In"];
+            for (int i = 0; i < ia.length; ++i) {
+                bool value = rng() & 1;
+                a.set(ia[i], value);
+                b.set(ib[i], value);
+            }
+            srand(r);
+            a.tickLevels();
+            srand(r);
+            b.tickParallel(pool, 64);
+            for (int i = 0; i < b.size(); ++i)
+                unstable += b.get(i) != a.get(i);
+        }
+        std::cout << "parallel: " << latches.count() << " gates with RS, " << unstable << " mismatches" << std::endl;
+        errors += unstable;
+    }
+
+    for (int n = 1; n <= threads; ++n) {
+        ThreadPool pool(n);
+        parallel.tickParallel(pool);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 50; ++i)
+            parallel.tickParallel(pool);
+        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << n << " threads: " << elapsed.count() / 50 << " us/tick" << std::endl;
+    }
+    return errors;
+}
+
+int checkElaborate(const char *path, int threads)
+{
+    uint64_t expected;
+    GateId count;
+    try {
+        UnitParser p(path);
+        auto start = std::chrono::steady_clock::now();
+        p.elaborate();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        expected = boardHash(p.unit());
+        count = p.unit().count();
+        std::cout << "elaborate " << path << ": " << count << " gates, serial " << elapsed.count() << " ms" << std::endl;
+    } catch (const char *err) {
+        std::cout << path << ": " << err << std::endl;
+        return 1;
+    }
+    int errors = 0;
+    for (int n = 1; n <= threads; ++n) {
+        ThreadPool pool(n);
+        UnitParser p(path);
+        auto start = std::chrono::steady_clock::now();
+        try {
+            p.elaborateParallel(pool);
+        } catch (const char *err) {
+            std::cout << n << " threads: " << err << std::endl;
+            errors++;
+            continue;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        bool same = boardHash(p.unit()) == expected;
+        errors += !same;
+        std::cout << n << " threads: " << elapsed.count() << " ms" << (same ? "" : ", board differs") << std::endl;
+    }
+    return errors;
+}
+
+int runCheck(int argc, char **argv)
+{
+    std::string name = argv[0];
+    if (name == "optimize")
+        return checkOptimize();
+    if (name == "events")
+        return checkEvents();
+    if (name == "probes")
+        return checkProbes();
+    if (name == "settle")
+        return checkSettle();
+    if (name == "jit") {
+        const char *paths[] = { "Alu64.txt", "Texte.txt" };
+        int errors = 0;
+        if (argc > 1) {
+            for (int i = 1; i < argc; ++i)
+                errors += checkJit(argv[i]);
+        } else {
+            for (auto path : paths)
+                errors += checkJit(path);
+        }
+        return errors;
+    }
+    if (name == "elaborate") {
+        int threads = (int)std::thread::hardware_concurrency();
+        return checkElaborate(argc > 1 ? argv[1] : "Blocks.txt", std::max(threads, 2));
+    }
+    if (name == "parallel") {
+        int threads = (int)std::thread::hardware_concurrency();
+        return checkParallel(argc > 1 ? std::stoi(argv[1]) : 1 << 20, std::max(threads, 2));
+    }
+    std::cout << "Unknown check " << name << std::endl;
+    return -1;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// Differential checks of the engines, run as "xpu <check> [args]" from the
+// project directory. Each one prints its findings and returns the number
+// of mismatches.
+int checkOptimize();
+// Event ticks on a chain mixing inputs and gates, levelized once midway
+int checkEvents();
+// Reads of a probed board against a full tick, with gates reading a REG
+// pulled into the cone after the edge
+int checkProbes();
+// Netlist::settle() on a NOR latch and on an oscillator, both closed with
+// Netlist::connect()
+int checkSettle();
+
+// NetlistJit, native and interpreted, against UnitBuilder::tickLanes() on
+// random lanes, then against tick() lane by lane
+int checkJit(const char *path);
+
+// Netlist::tickParallel() against tickLevels() and UnitBuilder::tick() on
+// a random netlist with wide levels, then against tickLevels() on one
+// with RS gates, and the time of a tick per thread count up to threads
+int checkParallel(int gates, int threads);
+
+// Board built by elaborateParallel() against elaborate() for each thread
+// count up to threads, with the time of each elaboration
+int checkElaborate(const char *path, int threads);
+
+// Name and arguments of a check, -1 when the check is unknown
+int runCheck(int argc, char **argv);
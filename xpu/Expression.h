@@ -1,6 +1,7 @@
 #pragma once
 #include <stack>
 #include <vector>
+#include <utility>
 
 template <class Nd>
 class Expression
@@ -10,14 +11,17 @@ private:
     {
         Start, Value, SingleR2L, SingleL2R, Binary, End
     };
-    std::stack<Nd> postfix;
-    std::stack<Nd> infix;
+    std::stack<Nd, std::vector<Nd>> postfix;
+    std::stack<Nd, std::vector<Nd>> infix;
+    std::vector<Nd> operands;
     ExStatus lastEntry;
 public:
+    Expression() : lastEntry(ExStatus::Start) {}
+
     void addOperand(Nd node)
     {
         setEntry(ExStatus::Value);
-        postfix.push(node);
+        postfix.push(std::move(node));
     }
 
     void addOperator(Nd node)
@@ -26,7 +30,7 @@ public:
         setEntry(n == 1 ? ExStatus::SingleR2L : ExStatus::Binary);
         while (infix.size() > 0 && infix.top().priority() <= node.priority())
             infixToPostfix();
-        infix.push(node);
+        infix.push(std::move(node));
     }
 
     Nd compile()
@@ -36,25 +40,25 @@ public:
             infixToPostfix();
         if (postfix.size() != 1)
             throw "Error";
-        return postfix.top();
+        return std::move(postfix.top());
     }
     
 
 private:
     void infixToPostfix()
     {
-        auto nd = infix.top();
+        auto nd = std::move(infix.top());
         infix.pop();
-        std::vector<Nd> operands;
         int n = nd.operands();
         if (n == 0 || postfix.size() < n)
             throw "Error";
-        for (int i = 0; i < n; ++i) {
-            operands.insert(operands.begin(), postfix.top());
+        operands.resize(n);
+        for (int i = n - 1; i >= 0; --i) {
+            operands[i] = std::move(postfix.top());
             postfix.pop();
         }
         nd.children(operands);
-        postfix.push(nd);
+        postfix.push(std::move(nd));
     }
 
     void setEntry(ExStatus status)
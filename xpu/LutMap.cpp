@@ -0,0 +1,442 @@
+#include "LutMap.h"
+#include <iostream>
+#include <algorithm>
+
+// Output of a combinational gate on single values, missing pins read as 0
+static bool gateValue(const LogicalGate &g, const bool *v)
+{
+    switch (g.opcode) {
+    case GateOpcode::And:
+        return v[0] && v[1];
+    case GateOpcode::Or:
+        return v[0] || v[1];
+    case GateOpcode::Xor:
+        return v[0] != v[1];
+    case GateOpcode::Nand:
+        return !(v[0] && v[1]);
+    case GateOpcode::Nor:
+        return !(v[0] || v[1]);
+    case GateOpcode::Not:
+        return !v[0];
+    case GateOpcode::Mux:
+        return v[0] ? v[2] : v[1];
+    case GateOpcode::Maj3:
+        return (v[0] + v[1] + v[2]) >= 2;
+    case GateOpcode::Lut4:
+        return lutValue(g.table, v[0], v[1], v[2], v[3]);
+    default:
+        throw "Unsupported";
+    }
+}
+
+// Table with input k ignored, the inputs above it move down
+static uint16_t dropInput(uint16_t table, int k)
+{
+    uint16_t rs = lutCofactor(table, k, false) & 0xff;
+    return rs | rs << 8;
+}
+
+// Table read with input j taken from input perm[j]
+static uint16_t permute(uint16_t table, const int *perm, int n)
+{
+    uint16_t rs = 0;
+    for (int idx = 0; idx < 16; ++idx) {
+        int src = idx & ~((1 << n) - 1);
+        for (int j = 0; j < n; ++j)
+            src |= ((idx >> j) & 1) << perm[j];
+        rs |= ((table >> src) & 1) << idx;
+    }
+    return rs;
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+LutMapper::LutMapper(const UnitBuilder &builder)
+    : vectors(builder.namedVectors())
+{
+    int length = builder.count32();
+    gates.reserve(length);
+    for (int i = 0; i < length; ++i)
+        gates.push_back(builder.gate(i));
+    cuts.resize((size_t)length * CUTS);
+    cutCount.assign(length, 0);
+    fanout.assign(length, 0);
+    arrival.assign(length, 0);
+    flows.assign(length, 0.0f);
+
+    for (int i = 0; i < length; ++i) {
+        auto &g = gates[i];
+        GateId pins[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+        for (int k = 0; k < 4; ++k) {
+            if (pins[k] >= 0)
+                fanout[pins[k]]++;
+        }
+    }
+    for (auto &pr : vectors) {
+        for (int i = 0; i < pr.second.length; ++i) {
+            if (pr.second[i] >= 0)
+                fanout[pr.second[i]]++;
+        }
+    }
+
+    for (int i = 0; i < length; ++i) {
+        if (isMapped(gates[i].opcode))
+            enumerate(i);
+    }
+}
+
+bool LutMapper::isMapped(GateOpcode opcode)
+{
+    switch (opcode) {
+    case GateOpcode::And:
+    case GateOpcode::Or:
+    case GateOpcode::Xor:
+    case GateOpcode::Nand:
+    case GateOpcode::Nor:
+    case GateOpcode::Not:
+    case GateOpcode::Mux:
+    case GateOpcode::Maj3:
+    case GateOpcode::Lut4:
+        return true;
+    default:
+        return false;
+    }
+}
+
+LutCut LutMapper::trivial(int idx) const
+{
+    LutCut cut;
+    cut.leaves[0] = idx;
+    cut.size = 1;
+    cut.table = 0xaaaa;
+    cut.depth = arrival[idx];
+    cut.flow = flows[idx];
+    return cut;
+}
+
+void LutMapper::keep(int idx, const LutCut &cut)
+{
+    LutCut *set = &cuts[(size_t)idx * CUTS];
+    int &count = cutCount[idx];
+    for (int k = 0; k < count; ++k) {
+        if (set[k].size == cut.size && std::equal(cut.leaves, cut.leaves + cut.size, set[k].leaves))
+            return;
+    }
+    auto better = [](const LutCut &a, const LutCut &b) {
+        if (a.depth != b.depth)
+            return a.depth < b.depth;
+        if (a.flow != b.flow)
+            return a.flow < b.flow;
+        return a.size < b.size;
+    };
+    int pos = count;
+    while (pos > 0 && better(cut, set[pos - 1]))
+        --pos;
+    if (pos >= CUTS)
+        return;
+    if (count < CUTS)
+        ++count;
+    for (int k = count - 1; k > pos; --k)
+        set[k] = set[k - 1];
+    set[pos] = cut;
+}
+
+void LutMapper::enumerate(int idx)
+{
+    auto &g = gates[idx];
+    GateId pins[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+
+    // Each distinct input takes one of its cuts or itself as a leaf
+    int fanins[4];
+    int slot[4];
+    int count = 0;
+    for (int k = 0; k < 4; ++k) {
+        slot[k] = -1;
+        if (pins[k] < 0)
+            continue;
+        for (int j = 0; j < count && slot[k] < 0; ++j) {
+            if (fanins[j] == pins[k])
+                slot[k] = j;
+        }
+        if (slot[k] < 0) {
+            slot[k] = count;
+            fanins[count++] = pins[k];
+        }
+    }
+    std::vector<LutCut> choices[4];
+    for (int j = 0; j < count; ++j) {
+        choices[j].push_back(trivial(fanins[j]));
+        const LutCut *set = &cuts[(size_t)fanins[j] * CUTS];
+        for (int k = 0; k < cutCount[fanins[j]]; ++k)
+            choices[j].push_back(set[k]);
+    }
+
+    int pick[4] = { 0, 0, 0, 0 };
+    for (;;) {
+        // Union of the leaves, give up past four
+        LutCut cut;
+        cut.size = 0;
+        bool fits = true;
+        for (int j = 0; j < count && fits; ++j) {
+            const LutCut &part = choices[j][pick[j]];
+            for (int q = 0; q < part.size && fits; ++q) {
+                int leaf = part.leaves[q];
+                int *end = cut.leaves + cut.size;
+                int *at = std::lower_bound(cut.leaves, end, leaf);
+                if (at != end && *at == leaf)
+                    continue;
+                if (cut.size == 4) {
+                    fits = false;
+                    break;
+                }
+                std::copy_backward(at, end, end + 1);
+                *at = leaf;
+                cut.size++;
+            }
+        }
+
+        if (fits) {
+            // Truth table over the leaves, each input read through its part
+            int pos[4][4];
+            for (int j = 0; j < count; ++j) {
+                const LutCut &part = choices[j][pick[j]];
+                for (int q = 0; q < part.size; ++q)
+                    pos[j][q] = (int)(std::lower_bound(cut.leaves, cut.leaves + cut.size, part.leaves[q]) - cut.leaves);
+            }
+            cut.table = 0;
+            for (int t = 0; t < 16; ++t) {
+                bool in[4];
+                for (int j = 0; j < count; ++j) {
+                    const LutCut &part = choices[j][pick[j]];
+                    int sub = 0;
+                    for (int q = 0; q < part.size; ++q)
+                        sub |= ((t >> pos[j][q]) & 1) << q;
+                    in[j] = (part.table >> sub) & 1;
+                }
+                bool v[4];
+                for (int k = 0; k < 4; ++k)
+                    v[k] = slot[k] >= 0 && in[slot[k]];
+                cut.table |= (uint16_t)gateValue(g, v) << t;
+            }
+
+            // Drop the leaves the function ignores
+            for (int k = cut.size; k-- > 0; ) {
+                if (lutCofactor(cut.table, k, false) != lutCofactor(cut.table, k, true))
+                    continue;
+                cut.table = dropInput(cut.table, k);
+                std::copy(cut.leaves + k + 1, cut.leaves + cut.size, cut.leaves + k);
+                cut.size--;
+            }
+
+            cut.depth = 0;
+            float flow = 1.0f;
+            for (int q = 0; q < cut.size; ++q) {
+                cut.depth = std::max(cut.depth, arrival[cut.leaves[q]]);
+                flow += flows[cut.leaves[q]];
+            }
+            cut.depth++;
+            cut.flow = flow / std::max(1, fanout[idx]);
+            keep(idx, cut);
+        }
+
+        int j = 0;
+        while (j < count && ++pick[j] == (int)choices[j].size())
+            pick[j++] = 0;
+        if (j == count)
+            break;
+    }
+
+    arrival[idx] = cuts[(size_t)idx * CUTS].depth;
+    flows[idx] = cuts[(size_t)idx * CUTS].flow;
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+int LutMapper::size() const
+{
+    return (int)gates.size();
+}
+
+int LutMapper::depth() const
+{
+    int rs = 0;
+    for (int d : arrival)
+        rs = std::max(rs, d);
+    return rs;
+}
+
+void LutMapper::apply(UnitBuilder &builder) const
+{
+    int length = (int)gates.size();
+
+    // Required time of every gate read by the cover, walking back from
+    // the outputs so all readers of a gate are done before it
+    std::vector<int> required(length, INT32_MAX);
+    std::vector<int> chosen(length, -1);
+    int target = 0;
+    auto root = [&](GateId idx) {
+        if (idx >= 0 && isMapped(gates[idx].opcode))
+            target = std::max(target, arrival[idx]);
+    };
+    for (auto &pr : vectors) {
+        for (int i = 0; i < pr.second.length; ++i)
+            root(pr.second[i]);
+    }
+    for (int i = 0; i < length; ++i) {
+        auto &g = gates[i];
+        if (isMapped(g.opcode))
+            continue;
+        root(g.pin1);
+        root(g.pin2);
+        root(g.pin3);
+        root(g.pin4);
+    }
+    auto need = [&](GateId idx, int time) {
+        if (idx >= 0 && isMapped(gates[idx].opcode))
+            required[idx] = std::min(required[idx], time);
+    };
+    for (auto &pr : vectors) {
+        for (int i = 0; i < pr.second.length; ++i)
+            need(pr.second[i], target);
+    }
+    for (int i = length; i-- > 0; ) {
+        auto &g = gates[i];
+        if (!isMapped(g.opcode)) {
+            need(g.pin1, target);
+            need(g.pin2, target);
+            need(g.pin3, target);
+            need(g.pin4, target);
+            continue;
+        }
+        if (required[i] == INT32_MAX)
+            continue;
+        // Cheapest cut within the slack, the first one is the fastest
+        const LutCut *set = &cuts[(size_t)i * CUTS];
+        int best = 0;
+        for (int k = 1; k < cutCount[i]; ++k) {
+            if (set[k].depth <= required[i] && set[k].flow < set[best].flow)
+                best = k;
+        }
+        chosen[i] = best;
+        for (int q = 0; q < set[best].size; ++q)
+            need(set[best].leaves[q], required[i] - 1);
+    }
+
+    std::vector<LogicalGate> board;
+    std::vector<int> map(length, -1);
+    int constant[2] = { -1, -1 };
+    auto emit = [&](GateOpcode opcode, int pin1, int pin2, int pin3 = -1, int pin4 = -1, uint16_t table = 0) {
+        LogicalGate g;
+        g.opcode = opcode;
+        g.pin1 = pin1;
+        g.pin2 = pin2;
+        g.pin3 = pin3;
+        g.pin4 = pin4;
+        g.table = table;
+        g.value = false;
+        g.lanes = 0;
+        g.depth = 0;
+        g.usage = 0;
+        board.push_back(g);
+        return (int)board.size() - 1;
+    };
+    auto pinOf = [&](GateId idx) { return idx < 0 ? -1 : map[idx]; };
+
+    for (int i = 0; i < length; ++i) {
+        auto &g = gates[i];
+        if (!isMapped(g.opcode)) {
+            map[i] = emit(g.opcode, pinOf(g.pin1), pinOf(g.pin2), pinOf(g.pin3), pinOf(g.pin4), g.table);
+            board[map[i]].value = g.value;
+            board[map[i]].lanes = g.lanes;
+            continue;
+        }
+        if (chosen[i] < 0)
+            continue;
+        const LutCut &cut = cuts[(size_t)i * CUTS + chosen[i]];
+        int pins[4] = { -1, -1, -1, -1 };
+        for (int q = 0; q < cut.size; ++q)
+            pins[q] = map[cut.leaves[q]];
+        uint16_t table = cut.table & ((1 << (1 << cut.size)) - 1);
+        if (cut.size == 0) {
+            bool one = (cut.table & 1) != 0;
+            if (constant[one] < 0)
+                constant[one] = emit(one ? GateOpcode::One : GateOpcode::Zero, -1, -1);
+            map[i] = constant[one];
+            continue;
+        }
+        if (cut.size == 1 && table == 0x2) {
+            map[i] = pins[0]; // Wire
+            continue;
+        }
+
+        GateOpcode opcode = GateOpcode::Lut4;
+        if (cut.size == 1) {
+            opcode = GateOpcode::Not;
+        } else if (cut.size == 2) {
+            switch (table) {
+            case 0x8: opcode = GateOpcode::And; break;
+            case 0xe: opcode = GateOpcode::Or; break;
+            case 0x6: opcode = GateOpcode::Xor; break;
+            case 0x7: opcode = GateOpcode::Nand; break;
+            case 0x1: opcode = GateOpcode::Nor; break;
+            default: break;
+            }
+        } else if (cut.size == 3 && table == 0xe8) {
+            opcode = GateOpcode::Maj3;
+        } else if (cut.size == 3) {
+            // Mux with the select on any leaf and the data in either order
+            static const int orders[6][3] = { { 0, 1, 2 }, { 0, 2, 1 }, { 1, 0, 2 }, { 1, 2, 0 }, { 2, 0, 1 }, { 2, 1, 0 } };
+            for (auto &perm : orders) {
+                if ((permute(cut.table, perm, 3) & 0xff) != 0xe4)
+                    continue;
+                int p[3] = { pins[perm[0]], pins[perm[1]], pins[perm[2]] };
+                std::copy(p, p + 3, pins);
+                opcode = GateOpcode::Mux;
+                break;
+            }
+        }
+        map[i] = emit(opcode, pins[0], pins[1], pins[2], pins[3],
+            opcode == GateOpcode::Lut4 ? cut.table : 0);
+        board[map[i]].value = g.value;
+        board[map[i]].lanes = g.lanes;
+    }
+
+    std::map<std::string, LogicalVector> named;
+    for (auto &pr : vectors) {
+        LogicalVector rs(pr.second.length);
+        for (int i = 0; i < pr.second.length; ++i) {
+            if (pr.second[i] >= 0)
+                rs.set(i, map[pr.second[i]]);
+        }
+        rs.pack();
+        named.insert(std::make_pair(pr.first, rs));
+    }
+    builder.rebuild(board, named);
+}
+
+void LutMapper::map(UnitBuilder &builder)
+{
+    int before = builder.count32();
+    int depthBefore = builder.depth();
+    std::vector<LogicalGate> board;
+    for (int i = 0; i < before; ++i)
+        board.push_back(builder.gate(i));
+    std::map<std::string, LogicalVector> named = builder.namedVectors();
+
+    LutMapper mapper(builder);
+    mapper.apply(builder);
+
+    int luts = 0;
+    for (int i = 0; i < builder.count32(); ++i) {
+        if (builder.gate(i).opcode == GateOpcode::Lut4)
+            luts++;
+    }
+    std::cout << "LUT (" << before << " -> " << builder.count() << " gates, depth "
+        << depthBefore << " -> " << builder.depth() << ", " << luts << " luts)";
+    if (builder.count() >= before && builder.depth() >= depthBefore) {
+        // Nothing gained, keep the netlist we had
+        builder.rebuild(board, named);
+        std::cout << " kept";
+    }
+    std::cout << std::endl;
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include "UnitBuilder.h"
+
+// Set of at most four gates whose values decide the output of a gate
+struct LutCut
+{
+public:
+    int leaves[4]; // Sorted gate indices
+    int size;
+    uint16_t table; // Lut4 order, inputs above size are ignored
+    int depth;
+    float flow;
+};
+
+// Cover the combinational gates of a UnitBuilder with cuts of at most four
+// inputs. Each gate keeps its best cuts by depth then area flow, the cover
+// starts from the named vectors and the pins of stateful gates and takes
+// the cheapest cut that doesn't make the cover deeper. A cut computing a
+// two input gate, a Mux or a Maj3 is emitted as that gate, other ones as a
+// Lut4.
+class LutMapper
+{
+private:
+    static const int CUTS = 8;
+    std::vector<LogicalGate> gates;
+    std::vector<LutCut> cuts; // CUTS slots per gate
+    std::vector<int> cutCount;
+    std::vector<int> fanout;
+    std::vector<int> arrival;
+    std::vector<float> flows;
+    std::map<std::string, LogicalVector> vectors;
+
+    static bool isMapped(GateOpcode opcode);
+    LutCut trivial(int idx) const;
+    void enumerate(int idx);
+    void keep(int idx, const LutCut &cut);
+public:
+    LutMapper(const UnitBuilder &builder);
+
+    // Gates of the cover and its depth
+    int size() const;
+    int depth() const;
+
+    // Pick the cover and rebuild the board with it
+    void apply(UnitBuilder &builder) const;
+
+    // Map and keep the result if it has fewer gates or less depth. Indices
+    // taken before must be looked up again.
+    static void map(UnitBuilder &builder);
+};
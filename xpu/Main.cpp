@@ -1,6 +1,11 @@
 #include "UnitParser.h"
+#include "Netlist.h"
+#include "NetlistJit.h"
+#include "Checks.h"
 #include "Lexer.h"
 #include <vector>
+#include <chrono>
+#include <random>
 
 #include <stdio.h>
 extern "C" {
@@ -751,6 +756,8 @@ private:
 
 int main(int argc, char **argv)
 {
+    if (argc > 1)
+        return runCheck(argc - 1, argv + 1);
 #if 0
     UnitParser p("C:/Users/Aesga/develop/xpu/xpu/Texte.txt");
     p.parse();
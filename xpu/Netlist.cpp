@@ -0,0 +1,599 @@
+#include "Netlist.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+Netlist::Netlist(const UnitBuilder &builder)
+    : length(builder.count32()), opcodes(length), pins1(length), pins2(length),
+    pins3(length), pins4(length), tables(length), values((length + 63) / 64, 0), vectors(builder.namedVectors()), levelized(false), levels(0), firstGate(0), stageGrain(0),
+    pending(0), settled(false), activityThreshold(0.25), activity(0), settleLimit(0)
+{
+    if (builder.cellCount() > 0)
+        throw "Unsupported"; // Macro cells only run on UnitBuilder
+    for (int i = 0; i < length; ++i) {
+        auto &g = builder.gate(i);
+        opcodes[i] = g.opcode;
+        pins1[i] = g.pin1;
+        pins2[i] = g.pin2;
+        pins3[i] = g.pin3;
+        pins4[i] = g.pin4;
+        tables[i] = g.table;
+        setBit(i, g.value);
+    }
+}
+
+bool Netlist::eval(int idx) const
+{
+    int p1 = pins1[idx];
+    int p2 = pins2[idx];
+    switch (opcodes[idx]) {
+    case GateOpcode::Zero:
+        return false;
+    case GateOpcode::One:
+        return true;
+    case GateOpcode::Clk:
+        return !bit(idx);
+    case GateOpcode::RS: {
+        bool r = bit(p1);
+        bool s = bit(p2);
+        if (r && !s)
+            return false; // Reset
+        else if (!r && s)
+            return true; // Set
+        else if (r && s)
+            return !(rand() % 2); // Instable
+        return bit(idx);
+    }
+    case GateOpcode::And:
+        return bit(p1) && bit(p2);
+    case GateOpcode::Or:
+        return bit(p1) || bit(p2);
+    case GateOpcode::Xor:
+        return bit(p1) != bit(p2);
+    case GateOpcode::Nand:
+        return !(bit(p1) && bit(p2));
+    case GateOpcode::Nor:
+        return !(bit(p1) || bit(p2));
+    case GateOpcode::Not:
+        return !bit(p1);
+    case GateOpcode::Mux:
+        return bit(p1) ? bit(pins3[idx]) : bit(p2);
+    case GateOpcode::Maj3:
+        return bit(p1) + bit(p2) + bit(pins3[idx]) >= 2;
+    case GateOpcode::Lut4:
+        return lutValue(tables[idx], bit(p1), p2 >= 0 && bit(p2),
+            pins3[idx] >= 0 && bit(pins3[idx]), pins4[idx] >= 0 && bit(pins4[idx]));
+    default:
+        return bit(idx);
+    }
+}
+
+void Netlist::tick()
+{
+    const GateOpcode *op = opcodes.data();
+    const int *p1 = pins1.data();
+    const int *p2 = pins2.data();
+    for (int i = 0; i < length; ++i) {
+        switch (op[i]) {
+        case GateOpcode::Zero:
+            setBit(i, false);
+            break;
+        case GateOpcode::One:
+            setBit(i, true);
+            break;
+        case GateOpcode::Clk:
+            setBit(i, !bit(i));
+            break;
+        case GateOpcode::Fix:
+            break;
+        case GateOpcode::RS: {
+            bool r = bit(p1[i]);
+            bool s = bit(p2[i]);
+            if (r && !s)
+                setBit(i, false); // Reset
+            else if (!r && s)
+                setBit(i, true); // Set
+            else if (r && s)
+                setBit(i, !(rand() % 2)); // Instable
+            break;
+        }
+        case GateOpcode::And:
+            setBit(i, bit(p1[i]) && bit(p2[i]));
+            break;
+        case GateOpcode::Or:
+            setBit(i, bit(p1[i]) || bit(p2[i]));
+            break;
+        case GateOpcode::Xor:
+            setBit(i, bit(p1[i]) != bit(p2[i]));
+            break;
+        case GateOpcode::Nand:
+            setBit(i, !(bit(p1[i]) && bit(p2[i])));
+            break;
+        case GateOpcode::Nor:
+            setBit(i, !(bit(p1[i]) || bit(p2[i])));
+            break;
+        case GateOpcode::Not:
+            setBit(i, !bit(p1[i]));
+            break;
+        case GateOpcode::Mux:
+        case GateOpcode::Maj3:
+        case GateOpcode::Lut4:
+            setBit(i, eval(i));
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static bool isScheduled(GateOpcode opcode)
+{
+    return opcode != GateOpcode::Fix && opcode != GateOpcode::In && opcode != GateOpcode::Out;
+}
+
+int Netlist::computeDepth(std::vector<int> &depth) const
+{
+    int count = 0;
+    depth.assign(length, 0);
+    for (int i = 0; i < length; ++i) {
+        if (pins1[i] >= 0 && depth[pins1[i]] >= depth[i])
+            depth[i] = depth[pins1[i]] + 1;
+        if (pins2[i] >= 0 && depth[pins2[i]] >= depth[i])
+            depth[i] = depth[pins2[i]] + 1;
+        if (pins3[i] >= 0 && depth[pins3[i]] >= depth[i])
+            depth[i] = depth[pins3[i]] + 1;
+        if (pins4[i] >= 0 && depth[pins4[i]] >= depth[i])
+            depth[i] = depth[pins4[i]] + 1;
+        if (depth[i] + 1 > count)
+            count = depth[i] + 1;
+    }
+    return count;
+}
+
+void Netlist::levelize()
+{
+    std::vector<int> depth;
+    levels = computeDepth(depth);
+
+    // Counting sort on (depth, opcode), insertion order is kept inside a
+    // group. Inputs and pass-through gates go first in bucket zero.
+    const int nop = (int)GateOpcode::Lut4 + 1;
+    std::vector<int> bucket(levels * nop + 2, 0);
+    std::vector<int> key(length);
+    for (int i = 0; i < length; ++i) {
+        key[i] = isScheduled(opcodes[i]) ? 1 + depth[i] * nop + (int)opcodes[i] : 0;
+        bucket[key[i] + 1]++;
+    }
+    for (int k = 1; k < (int)bucket.size(); ++k)
+        bucket[k] += bucket[k - 1];
+
+    groups.clear();
+    for (int k = 1; k <= levels * nop; ++k) {
+        if (bucket[k] != bucket[k + 1])
+            groups.push_back(GateGroup{ (GateOpcode)((k - 1) % nop), bucket[k], bucket[k + 1] });
+    }
+    levelStart.resize(levels + 1);
+    for (int d = 0; d <= levels; ++d)
+        levelStart[d] = bucket[1 + d * nop];
+    stages.clear();
+
+    // Renumber gates in schedule order so each group covers a contiguous
+    // range of gates.
+    std::vector<int> position(length);
+    for (int i = 0; i < length; ++i)
+        position[i] = bucket[key[i]]++;
+
+    std::vector<GateOpcode> op(length);
+    std::vector<int> p1(length);
+    std::vector<int> p2(length);
+    std::vector<int> p3(length);
+    std::vector<int> p4(length);
+    std::vector<uint16_t> tb(length);
+    std::vector<uint64_t> vl(values.size(), 0);
+    for (int i = 0; i < length; ++i) {
+        int k = position[i];
+        op[k] = opcodes[i];
+        p1[k] = pins1[i] >= 0 ? position[pins1[i]] : pins1[i];
+        p2[k] = pins2[i] >= 0 ? position[pins2[i]] : pins2[i];
+        p3[k] = pins3[i] >= 0 ? position[pins3[i]] : pins3[i];
+        p4[k] = pins4[i] >= 0 ? position[pins4[i]] : pins4[i];
+        tb[k] = tables[i];
+        vl[k >> 6] |= (uint64_t)bit(i) << (k & 63);
+    }
+    work.assign(values.size() * 64, 0);
+    firstGate = bucket[0]; // End of the unscheduled gates after the fill
+    opcodes.swap(op);
+    pins1.swap(p1);
+    pins2.swap(p2);
+    pins3.swap(p3);
+    pins4.swap(p4);
+    tables.swap(tb);
+    values.swap(vl);
+
+    for (auto &pr : vectors) {
+        LogicalVector rs(pr.second.length);
+        for (int i = 0; i < rs.length; ++i) {
+            if (pr.second[i] >= 0)
+                rs.set(i, position[pr.second[i]]);
+        }
+        pr.second = rs;
+    }
+    levelized = true;
+
+    // The fanout of the event engine refers to the old numbers, it is
+    // built again by the next tickEvents()
+    for (int &idx : clocked)
+        idx = position[idx];
+    fanoutStart.clear();
+    fanoutList.clear();
+    events.clear();
+    queued.clear();
+    pending = 0;
+    settled = false;
+}
+
+void Netlist::loadWork()
+{
+    for (int k = 0; k < firstGate; ++k)
+        work[k] = bit(k);
+}
+
+void Netlist::storeWork()
+{
+    // Gather the low bit of 8 bytes at once (work is padded to 64 gates)
+    const uint8_t *v = work.data();
+    for (int w = 0, n = (int)values.size(); w < n; ++w) {
+        uint64_t word = 0;
+        for (int b = 0; b < 8; ++b) {
+            uint64_t bytes;
+            memcpy(&bytes, &v[(w << 6) + (b << 3)], 8);
+            word |= ((bytes * 0x0102040810204080ULL) >> 56) << (b << 3);
+        }
+        values[w] = word;
+    }
+}
+
+void Netlist::evalGroups(int begin, int end, bool unstable)
+{
+    uint8_t *v = work.data();
+    const int *p1 = pins1.data();
+    const int *p2 = pins2.data();
+    const int *p3 = pins3.data();
+    const int *p4 = pins4.data();
+    auto it = std::upper_bound(groups.begin(), groups.end(), begin,
+        [](int idx, const GateGroup &grp) { return idx < grp.end; });
+    for (; it != groups.end() && it->begin < end; ++it) {
+        auto &grp = *it;
+        if (grp.opcode == GateOpcode::RS && !unstable)
+            continue;
+        int k = std::max(begin, grp.begin);
+        int last = std::min(end, grp.end);
+        switch (grp.opcode) {
+        case GateOpcode::Zero:
+            for (; k < last; ++k)
+                v[k] = 0;
+            break;
+        case GateOpcode::One:
+            for (; k < last; ++k)
+                v[k] = 1;
+            break;
+        case GateOpcode::Clk:
+            for (; k < last; ++k)
+                v[k] = !bit(k);
+            break;
+        case GateOpcode::RS:
+            for (; k < last; ++k) {
+                if (v[p1[k]] && v[p2[k]])
+                    v[k] = !(rand() % 2); // Instable
+                else if (v[p1[k]] || v[p2[k]])
+                    v[k] = v[p2[k]];
+                else
+                    v[k] = bit(k);
+            }
+            break;
+        case GateOpcode::And:
+            for (; k < last; ++k)
+                v[k] = v[p1[k]] & v[p2[k]];
+            break;
+        case GateOpcode::Or:
+            for (; k < last; ++k)
+                v[k] = v[p1[k]] | v[p2[k]];
+            break;
+        case GateOpcode::Xor:
+            for (; k < last; ++k)
+                v[k] = v[p1[k]] ^ v[p2[k]];
+            break;
+        case GateOpcode::Nand:
+            for (; k < last; ++k)
+                v[k] = !(v[p1[k]] & v[p2[k]]);
+            break;
+        case GateOpcode::Nor:
+            for (; k < last; ++k)
+                v[k] = !(v[p1[k]] | v[p2[k]]);
+            break;
+        case GateOpcode::Not:
+            for (; k < last; ++k)
+                v[k] = !v[p1[k]];
+            break;
+        case GateOpcode::Mux:
+            for (; k < last; ++k)
+                v[k] = v[p1[k]] ? v[p3[k]] : v[p2[k]];
+            break;
+        case GateOpcode::Maj3:
+            for (; k < last; ++k)
+                v[k] = v[p1[k]] + v[p2[k]] + v[p3[k]] >= 2;
+            break;
+        case GateOpcode::Lut4:
+            for (; k < last; ++k) {
+                int idx = v[p1[k]] | (p2[k] >= 0 ? v[p2[k]] << 1 : 0)
+                    | (p3[k] >= 0 ? v[p3[k]] << 2 : 0) | (p4[k] >= 0 ? v[p4[k]] << 3 : 0);
+                v[k] = (tables[k] >> idx) & 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void Netlist::tickLevels()
+{
+    if (!levelized)
+        levelize();
+
+    // Evaluate on one byte per gate, the bitset is only read for inputs and
+    // stateful gates and written back once at the end of the pass.
+    loadWork();
+    evalGroups(firstGate, length);
+    storeWork();
+}
+
+void Netlist::tickParallel(ThreadPool &pool, int grain)
+{
+    if (!levelized)
+        levelize();
+    if (grain < 1)
+        grain = 1;
+
+    if (stages.empty() || stageGrain != grain) {
+        stages.clear();
+        stageGrain = grain;
+        for (int d = 0; d < levels; ++d) {
+            int begin = levelStart[d];
+            int end = levelStart[d + 1];
+            if (begin >= end)
+                continue;
+            if (end - begin >= 2 * grain)
+                stages.push_back(GateStage{ begin, end, true, false });
+            else if (!stages.empty() && !stages.back().parallel)
+                stages.back().end = end;
+            else
+                stages.push_back(GateStage{ begin, end, false, false });
+        }
+        for (auto &grp : groups) {
+            if (grp.opcode != GateOpcode::RS)
+                continue;
+            for (auto &st : stages) {
+                if (st.parallel && grp.begin >= st.begin && grp.end <= st.end)
+                    st.unstable = true;
+            }
+        }
+    }
+
+    loadWork();
+    for (auto &st : stages) {
+        if (!st.parallel) {
+            evalGroups(st.begin, st.end);
+            continue;
+        }
+        int chunks = (st.end - st.begin) / grain;
+        pool.run(chunks, [&](int c) {
+            int begin = st.begin + (int)((int64_t)(st.end - st.begin) * c / chunks);
+            int end = st.begin + (int)((int64_t)(st.end - st.begin) * (c + 1) / chunks);
+            evalGroups(begin, end, false);
+        });
+        if (st.unstable) {
+            for (auto &grp : groups) {
+                if (grp.opcode == GateOpcode::RS && grp.begin >= st.begin && grp.end <= st.end)
+                    evalGroups(grp.begin, grp.end);
+            }
+        }
+    }
+    storeWork();
+}
+
+void Netlist::buildFanout()
+{
+    // Distinct pins of a gate
+    auto readers = [this](int i, int *pins) {
+        int from[4] = { pins1[i], pins2[i], pins3[i], pins4[i] };
+        int n = 0;
+        for (int pin : from) {
+            if (pin >= 0 && std::find(pins, pins + n, pin) == pins + n)
+                pins[n++] = pin;
+        }
+        return n;
+    };
+    int pins[4];
+    fanoutStart.assign(length + 1, 0);
+    for (int i = 0; i < length; ++i) {
+        for (int k = 0, n = readers(i, pins); k < n; ++k)
+            fanoutStart[pins[k] + 1]++;
+    }
+    for (int i = 0; i < length; ++i)
+        fanoutStart[i + 1] += fanoutStart[i];
+
+    std::vector<int> fill(fanoutStart.begin(), fanoutStart.end() - 1);
+    fanoutList.resize(fanoutStart[length]);
+    clocked.clear();
+    for (int i = 0; i < length; ++i) {
+        for (int k = 0, n = readers(i, pins); k < n; ++k)
+            fanoutList[fill[pins[k]]++] = i;
+        if (opcodes[i] == GateOpcode::Clk || opcodes[i] == GateOpcode::RS)
+            clocked.push_back(i);
+    }
+
+    events.assign(computeDepth(gateDepth), std::vector<int>());
+    queued.assign(length, 0);
+    pending = 0;
+    settled = false;
+}
+
+void Netlist::schedule(int idx)
+{
+    if (queued[idx])
+        return;
+    queued[idx] = 1;
+    events[gateDepth[idx]].push_back(idx);
+    pending++;
+}
+
+void Netlist::scheduleFanout(int idx)
+{
+    for (int k = fanoutStart[idx]; k < fanoutStart[idx + 1]; ++k)
+        schedule(fanoutList[k]);
+}
+
+void Netlist::tickEvents()
+{
+    if (fanoutStart.empty())
+        buildFanout();
+
+    // Stateful gates may change without any input event
+    for (int idx : clocked)
+        schedule(idx);
+
+    if (!settled || pending > activityThreshold * length) {
+        for (auto &lvl : events) {
+            for (int idx : lvl)
+                queued[idx] = 0;
+            lvl.clear();
+        }
+        pending = 0;
+        if (levelized)
+            tickLevels();
+        else
+            tick();
+        activity = length;
+        settled = true;
+        return;
+    }
+
+    // Gate numbers are in topological order, so depth buckets can be
+    // drained in order while new events only land in deeper buckets.
+    activity = 0;
+    for (auto &lvl : events) {
+        for (size_t k = 0; k < lvl.size(); ++k) {
+            int idx = lvl[k];
+            queued[idx] = 0;
+            activity++;
+            bool value = eval(idx);
+            if (value != bit(idx)) {
+                setBit(idx, value);
+                scheduleFanout(idx);
+            }
+        }
+        lvl.clear();
+    }
+    pending = 0;
+}
+
+static bool isStateful(GateOpcode opcode)
+{
+    return opcode == GateOpcode::Clk || opcode == GateOpcode::RS;
+}
+
+// One sweep of the two-phase engine: state elements at the edge,
+// combinational gates otherwise. Returns true if any value changed.
+bool Netlist::step(bool edge)
+{
+    int words = (int)values.size();
+    nextValues.resize(words);
+    bool changed = false;
+    for (int w = 0; w < words; ++w) {
+        uint64_t word = values[w];
+        int end = std::min(length, (w + 1) * 64);
+        for (int i = w * 64; i < end; ++i) {
+            if (isStateful(opcodes[i]) != edge)
+                continue;
+            uint64_t mask = (uint64_t)1 << (i & 63);
+            word = eval(i) ? word | mask : word & ~mask;
+        }
+        changed |= word != values[w];
+        nextValues[w] = word;
+    }
+    values.swap(nextValues);
+    if (changed)
+        settled = false; // Event engine has to do a full sweep
+    return changed;
+}
+
+int Netlist::settle(int limit)
+{
+    if (limit <= 0) {
+        if (settleLimit == 0) {
+            std::vector<int> depth;
+            settleLimit = computeDepth(depth) + 1;
+        }
+        limit = settleLimit;
+    }
+    for (int n = 1; n <= limit; ++n) {
+        if (!step(false))
+            return n;
+    }
+    return -1;
+}
+
+int Netlist::run(int cycles, int limit)
+{
+    int sweeps = 0;
+    for (int c = 0; c < cycles; ++c) {
+        step(true);
+        int n = settle(limit);
+        if (n < 0)
+            return -1;
+        sweeps += n;
+    }
+    return sweeps;
+}
+
+void Netlist::connect(int idx, int pin, int source)
+{
+    if (idx < 0 || idx >= length || source < 0 || source >= length)
+        throw "Invalid";
+    int *pins[] = { &pins1[idx], &pins2[idx], &pins3[idx], &pins4[idx] };
+    if (pin < 1 || pin > 4)
+        throw "Invalid";
+    *pins[pin - 1] = source;
+    // Depth and fanout no longer match the pins
+    settleLimit = 0;
+    fanoutStart.clear();
+    fanoutList.clear();
+    settled = false;
+}
+
+void Netlist::set(int idx, bool value)
+{
+    if (idx < 0 || idx >= length)
+        return;
+    if (settled && bit(idx) != value)
+        scheduleFanout(idx);
+    setBit(idx, value);
+}
+
+bool Netlist::get(int idx) const
+{
+    if (idx < 0 || idx >= length)
+        return false;
+    return bit(idx);
+}
+
+void Netlist::dump()
+{
+    for (auto pr : vectors) {
+        std::cout << pr.first << ": ";
+        for (int i = pr.second.length; i-- > 0; )
+            std::cout << (get(pr.second[i]) ? '1' : '0');
+        std::cout << std::endl;
+    }
+}
@@ -0,0 +1,144 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include "UnitBuilder.h"
+#include "ThreadPool.h"
+
+// Range of gates sharing the same depth and opcode
+struct GateGroup
+{
+    GateOpcode opcode;
+    int begin;
+    int end;
+};
+
+// Part of the schedule run between two barriers, either a large level split
+// in chunks across threads or a run of small levels done by one thread.
+// RS gates of a parallel stage call rand(), they are left to the calling
+// thread once the chunks are done.
+struct GateStage
+{
+    int begin;
+    int end;
+    bool parallel;
+    bool unstable;
+};
+
+// Frozen runtime form of a finished UnitBuilder. Build metadata (depth,
+// usage) is dropped and the hot state is split into flat arrays, with gate
+// values packed one bit per gate.
+class Netlist
+{
+private:
+    int length;
+    std::vector<GateOpcode> opcodes;
+    std::vector<int> pins1;
+    std::vector<int> pins2;
+    std::vector<int> pins3;
+    std::vector<int> pins4;
+    std::vector<uint16_t> tables;
+    std::vector<uint64_t> values;
+    std::map<std::string, LogicalVector> vectors;
+
+    // Levelized schedule, gates of a level are grouped by opcode
+    bool levelized;
+    int levels;
+    std::vector<GateGroup> groups;
+    std::vector<uint8_t> work;
+    int firstGate;
+    std::vector<int> levelStart;
+    std::vector<GateStage> stages;
+    int stageGrain;
+
+    void loadWork();
+    void evalGroups(int begin, int end, bool unstable = true);
+    void storeWork();
+
+    // Event-driven engine, fanout in compressed rows and pending gates
+    // bucketed by depth
+    std::vector<int> fanoutStart;
+    std::vector<int> fanoutList;
+    std::vector<int> gateDepth;
+    std::vector<std::vector<int>> events;
+    std::vector<uint8_t> queued;
+    std::vector<int> clocked;
+    int pending;
+    bool settled;
+    double activityThreshold;
+    int activity;
+
+    // Two-phase engine, each step reads one state buffer and writes the
+    // other so the order of the gates doesn't matter
+    std::vector<uint64_t> nextValues;
+    int settleLimit;
+
+    bool step(bool edge);
+
+    int computeDepth(std::vector<int> &depth) const;
+    bool eval(int idx) const;
+    void schedule(int idx);
+    void scheduleFanout(int idx);
+
+    bool bit(int idx) const { return (values[idx >> 6] >> (idx & 63)) & 1; }
+    void setBit(int idx, bool value)
+    {
+        uint64_t &word = values[idx >> 6];
+        word = (word & ~((uint64_t)1 << (idx & 63))) | ((uint64_t)value << (idx & 63));
+    }
+public:
+    Netlist(const UnitBuilder &builder);
+
+    int size() const { return length; }
+    LogicalVector operator[](const std::string &name) const
+    {
+        auto it = vectors.find(name);
+        if (it == vectors.end())
+            throw "Undefined";
+        return it->second;
+    }
+
+    void tick();
+    // Sort gates by depth then opcode, this renumbers the gates and the
+    // named vectors; indices taken before must be looked up again.
+    void levelize();
+    void tickLevels();
+    int depth() const { return levels; }
+
+    // Levels are split in chunks of at least grain gates run on the pool,
+    // levels smaller than grain are merged and run on the calling thread.
+    void tickParallel(ThreadPool &pool, int grain = 4096);
+
+    // Only re-evaluate gates downstream of changed values. When the
+    // fanout of the pending changes exceeds the threshold (ratio of the
+    // gate count) a full sweep is done instead.
+    void buildFanout();
+    void tickEvents();
+    void setActivityThreshold(double ratio) { activityThreshold = ratio; }
+    int lastActivity() const { return activity; }
+
+    // Sequential simulation. Combinational gates are swept from the
+    // previous state until no value changes, state elements (Clk, RS)
+    // commit together at the clock edge. settle() returns the number of
+    // sweeps, or -1 when the cap is reached before a fixed point; a cap
+    // of 0 uses the depth of the netlist, enough for any acyclic board.
+    // UnitBuilder only makes acyclic boards, feedback loops are closed
+    // with connect() and only settle(), edge() and run() support them.
+    int settle(int limit = 0);
+    void edge() { step(true); }
+    // Edge then settle for each cycle, returns the total sweeps or -1
+    int run(int cycles, int limit = 0);
+    // Rewire pin 1 to 4 of a gate to any gate, later ones included
+    void connect(int idx, int pin, int source);
+
+    void set(int idx, bool value);
+    void setU8(LogicalVector vc, unsigned value)
+    {
+        for (int i = 0; i < 8; ++i)
+            set(vc[i], (value >> i) & 1);
+    }
+    bool get(int idx) const;
+
+    void dump();
+};
@@ -0,0 +1,443 @@
+#include "NetlistJit.h"
+#include <cstring>
+#include <random>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define XPU_JIT
+#endif
+
+#if defined(XPU_JIT) && defined(_WIN32)
+#include <windows.h>
+#elif defined(XPU_JIT)
+#include <sys/mman.h>
+#endif
+
+NetlistJit::NetlistJit(const UnitBuilder &builder)
+    : length(builder.count32()), opcodes(length), pins1(length), pins2(length),
+    pins3(length), pins4(length), tables(length), words(length, 0), vectors(builder.namedVectors()),
+    code(nullptr), codeSize(0), entry(nullptr)
+{
+    if (builder.cellCount() > 0)
+        throw "Unsupported"; // Macro cells only run on UnitBuilder
+    for (int i = 0; i < length; ++i) {
+        auto &g = builder.gate(i);
+        opcodes[i] = g.opcode;
+        pins1[i] = g.pin1;
+        pins2[i] = g.pin2;
+        pins3[i] = g.pin3;
+        pins4[i] = g.pin4;
+        tables[i] = g.table;
+        words[i] = g.lanes;
+    }
+
+    std::vector<uint8_t> buf;
+    if (!generate(buf))
+        return;
+    void *ptr = nullptr;
+#if defined(XPU_JIT) && defined(_WIN32)
+    ptr = VirtualAlloc(NULL, buf.size(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (ptr == NULL)
+        return;
+    memcpy(ptr, buf.data(), buf.size());
+    DWORD prev;
+    if (!VirtualProtect(ptr, buf.size(), PAGE_EXECUTE_READ, &prev)) {
+        VirtualFree(ptr, 0, MEM_RELEASE);
+        return;
+    }
+#elif defined(XPU_JIT)
+    ptr = mmap(NULL, buf.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return;
+    memcpy(ptr, buf.data(), buf.size());
+    if (mprotect(ptr, buf.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(ptr, buf.size());
+        return;
+    }
+#else
+    return;
+#endif
+    code = ptr;
+    codeSize = buf.size();
+    entry = (void (*)(uint64_t *))ptr;
+}
+
+NetlistJit::~NetlistJit()
+{
+    if (code == nullptr)
+        return;
+#if defined(XPU_JIT) && defined(_WIN32)
+    VirtualFree(code, 0, MEM_RELEASE);
+#elif defined(XPU_JIT)
+    munmap(code, codeSize);
+#endif
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+enum X86Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7 };
+
+// Opcodes of the r/m64, r64 and r64, r/m64 forms
+const uint8_t X86_AND_RM = 0x21, X86_AND_R = 0x23;
+const uint8_t X86_OR_RM = 0x09, X86_OR_R = 0x0B;
+const uint8_t X86_XOR_RM = 0x31, X86_XOR_R = 0x33;
+const uint8_t X86_MOV_RM = 0x89, X86_MOV_R = 0x8B;
+
+class X86Emitter
+{
+private:
+    std::vector<uint8_t> &buf;
+    void rex(int reg, int rm) { buf.push_back(0x48 | ((reg >> 3) << 2) | (rm >> 3)); }
+    void disp32(int32_t disp)
+    {
+        for (int i = 0; i < 4; ++i)
+            buf.push_back((disp >> (i * 8)) & 0xff);
+    }
+public:
+    X86Emitter(std::vector<uint8_t> &buf) : buf(buf) {}
+
+    // op dst, src
+    void opRR(uint8_t op, int dst, int src)
+    {
+        rex(src, dst);
+        buf.push_back(op);
+        buf.push_back(0xC0 | (src & 7) << 3 | (dst & 7));
+    }
+    // op reg, [rdi + disp] or op [rdi + disp], reg
+    void opRM(uint8_t op, int reg, int32_t disp)
+    {
+        rex(reg, RDI);
+        buf.push_back(op);
+        buf.push_back(0x80 | (reg & 7) << 3 | RDI);
+        disp32(disp);
+    }
+    void notR(int reg)
+    {
+        rex(0, reg);
+        buf.push_back(0xF7);
+        buf.push_back(0xD0 | (reg & 7));
+    }
+    void onesR(int reg)
+    {
+        rex(0, reg);
+        buf.push_back(0xC7);
+        buf.push_back(0xC0 | (reg & 7));
+        disp32(-1);
+    }
+    void push(int reg)
+    {
+        if (reg >= 8)
+            buf.push_back(0x41);
+        buf.push_back(0x50 | (reg & 7));
+    }
+    void pop(int reg)
+    {
+        if (reg >= 8)
+            buf.push_back(0x41);
+        buf.push_back(0x58 | (reg & 7));
+    }
+    void ret() { buf.push_back(0xC3); }
+};
+
+// rdi holds the word array, every other general register but rsp and rbp
+// is allocated to gate words.
+static const int allocatable[] = { RAX, RCX, RDX, RBX, RSI, 8, 9, 10, 11, 12, 13, 14, 15 };
+#if defined(_WIN32)
+static const int preserved[] = { RBX, RSI, RDI, 12, 13, 14, 15 };
+#else
+static const int preserved[] = { RBX, 12, 13, 14, 15 };
+#endif
+
+bool NetlistJit::generate(std::vector<uint8_t> &buf)
+{
+#if !defined(XPU_JIT)
+    return false;
+#else
+    if ((int64_t)length * 8 > INT32_MAX)
+        return false;
+    for (int i = 0; i < length; ++i) {
+        if (opcodes[i] == GateOpcode::RS || opcodes[i] == GateOpcode::Maj3 || opcodes[i] == GateOpcode::Lut4)
+            return false;
+    }
+
+    // Last gate reading each value, a register is free once passed
+    std::vector<int> lastUse(length);
+    for (int i = 0; i < length; ++i) {
+        lastUse[i] = i;
+        if (pins1[i] >= 0)
+            lastUse[pins1[i]] = i;
+        if (pins2[i] >= 0)
+            lastUse[pins2[i]] = i;
+        if (pins3[i] >= 0)
+            lastUse[pins3[i]] = i;
+    }
+    std::vector<int8_t> gateReg(length, -1);
+    int regGate[16];
+    for (int r = 0; r < 16; ++r)
+        regGate[r] = -1;
+
+    auto alloc = [&](int cur, int keep1, int keep2) {
+        int best = -1;
+        for (int r : allocatable) {
+            if (r == keep1 || r == keep2)
+                continue;
+            int g = regGate[r];
+            if (g < 0 || lastUse[g] < cur) {
+                best = r;
+                break;
+            }
+            // Values are always stored, evict the one needed the latest
+            if (best < 0 || lastUse[g] > lastUse[regGate[best]])
+                best = r;
+        }
+        if (regGate[best] >= 0)
+            gateReg[regGate[best]] = -1;
+        regGate[best] = -1;
+        return best;
+    };
+
+    X86Emitter x86(buf);
+    auto load = [&](int reg, int gate) {
+        if (gateReg[gate] >= 0)
+            x86.opRR(X86_MOV_RM, reg, gateReg[gate]);
+        else
+            x86.opRM(X86_MOV_R, reg, gate * 8);
+    };
+    for (int r : preserved)
+        x86.push(r);
+#if defined(_WIN32)
+    x86.opRR(X86_MOV_RM, RDI, RCX); // Win64 passes the argument in rcx
+#endif
+
+    for (int i = 0; i < length; ++i) {
+        int a = pins1[i];
+        int b = pins2[i];
+        int rd = -1;
+        uint8_t opR = 0, opM = 0;
+        bool invert = false;
+        switch (opcodes[i]) {
+        case GateOpcode::Zero:
+            rd = alloc(i, -1, -1);
+            x86.opRR(X86_XOR_RM, rd, rd);
+            break;
+        case GateOpcode::One:
+            rd = alloc(i, -1, -1);
+            x86.onesR(rd);
+            break;
+        case GateOpcode::Clk:
+            rd = alloc(i, -1, -1);
+            x86.opRM(X86_MOV_R, rd, i * 8);
+            x86.notR(rd);
+            break;
+        case GateOpcode::And:
+        case GateOpcode::Nand:
+            opR = X86_AND_RM;
+            opM = X86_AND_R;
+            invert = opcodes[i] == GateOpcode::Nand;
+            break;
+        case GateOpcode::Or:
+        case GateOpcode::Nor:
+            opR = X86_OR_RM;
+            opM = X86_OR_R;
+            invert = opcodes[i] == GateOpcode::Nor;
+            break;
+        case GateOpcode::Xor:
+            opR = X86_XOR_RM;
+            opM = X86_XOR_R;
+            break;
+        case GateOpcode::Not:
+            invert = true;
+            break;
+        case GateOpcode::Mux: {
+            // rd = lo ^ ((lo ^ hi) & sel), values are always stored so an
+            // operand evicted by alloc is read back from memory
+            int sel = pins1[i];
+            rd = alloc(i, -1, -1);
+            load(rd, pins2[i]);
+            int tmp = alloc(i, rd, -1);
+            load(tmp, pins3[i]);
+            x86.opRR(X86_XOR_RM, tmp, rd);
+            if (gateReg[sel] >= 0)
+                x86.opRR(X86_AND_RM, tmp, gateReg[sel]);
+            else
+                x86.opRM(X86_AND_R, tmp, sel * 8);
+            x86.opRR(X86_XOR_RM, rd, tmp);
+            break;
+        }
+        default:
+            continue; // Fix, In, Out keep their word in memory
+        }
+
+        if (rd < 0) {
+            int ra = gateReg[a];
+            if (ra < 0) {
+                ra = alloc(i, b >= 0 ? gateReg[b] : -1, -1);
+                x86.opRM(X86_MOV_R, ra, a * 8);
+                regGate[ra] = a;
+                gateReg[a] = ra;
+            }
+            if (lastUse[a] == i && a != b) {
+                rd = ra; // Operand dies here, compute in place
+                gateReg[a] = -1;
+                regGate[ra] = -1;
+            } else {
+                rd = alloc(i, ra, b >= 0 ? gateReg[b] : -1);
+                x86.opRR(X86_MOV_RM, rd, ra);
+            }
+            if (opR != 0) {
+                if (b == a)
+                    x86.opRR(opR, rd, rd);
+                else if (gateReg[b] >= 0)
+                    x86.opRR(opR, rd, gateReg[b]);
+                else
+                    x86.opRM(opM, rd, b * 8);
+            }
+            if (invert)
+                x86.notR(rd);
+        }
+
+        x86.opRM(X86_MOV_RM, rd, i * 8);
+        regGate[rd] = i;
+        gateReg[i] = rd;
+    }
+
+    for (int k = sizeof(preserved) / sizeof(preserved[0]); k-- > 0; )
+        x86.pop(preserved[k]);
+    x86.ret();
+    return true;
+#endif
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+void NetlistJit::interpret()
+{
+    uint64_t *w = words.data();
+    for (int i = 0; i < length; ++i) {
+        int p1 = pins1[i];
+        int p2 = pins2[i];
+        switch (opcodes[i]) {
+        case GateOpcode::Zero:
+            w[i] = 0;
+            break;
+        case GateOpcode::One:
+            w[i] = ~(uint64_t)0;
+            break;
+        case GateOpcode::Clk:
+            w[i] = ~w[i];
+            break;
+        case GateOpcode::RS: {
+            uint64_t unstable = w[p1] & w[p2];
+            uint64_t noise = ((uint64_t)rand() << 48) ^ ((uint64_t)rand() << 32) ^ ((uint64_t)rand() << 16) ^ rand();
+            w[i] = (w[i] & ~(w[p1] & ~w[p2])) | (~w[p1] & w[p2]);
+            w[i] = (w[i] & ~unstable) | (noise & unstable); // Instable
+            break;
+        }
+        case GateOpcode::And:
+            w[i] = w[p1] & w[p2];
+            break;
+        case GateOpcode::Or:
+            w[i] = w[p1] | w[p2];
+            break;
+        case GateOpcode::Xor:
+            w[i] = w[p1] ^ w[p2];
+            break;
+        case GateOpcode::Nand:
+            w[i] = ~(w[p1] & w[p2]);
+            break;
+        case GateOpcode::Nor:
+            w[i] = ~(w[p1] | w[p2]);
+            break;
+        case GateOpcode::Not:
+            w[i] = ~w[p1];
+            break;
+        case GateOpcode::Mux:
+            w[i] = (w[p2] & ~w[p1]) | (w[pins3[i]] & w[p1]);
+            break;
+        case GateOpcode::Maj3: {
+            uint64_t c = w[pins3[i]];
+            w[i] = (w[p1] & w[p2]) | (w[p1] & c) | (w[p2] & c);
+            break;
+        }
+        case GateOpcode::Lut4:
+            w[i] = lutLanes(tables[i], w[p1], p2 >= 0 ? w[p2] : 0,
+                pins3[i] >= 0 ? w[pins3[i]] : 0, pins4[i] >= 0 ? w[pins4[i]] : 0);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void NetlistJit::tick()
+{
+    if (entry != nullptr)
+        entry(words.data());
+    else
+        interpret();
+}
+
+void NetlistJit::setLanes(int idx, uint64_t lanes)
+{
+    if (idx < 0 || idx >= length)
+        return;
+    words[idx] = lanes;
+}
+
+uint64_t NetlistJit::getLanes(int idx) const
+{
+    if (idx < 0 || idx >= length)
+        return 0;
+    return words[idx];
+}
+
+void NetlistJit::setLanes(LogicalVector vc, const uint64_t *values, int count)
+{
+    if (count < 0 || count > UnitBuilder::LANES || vc.length > 64)
+        throw "Out of range";
+    for (int i = 0; i < vc.length; ++i) {
+        uint64_t word = 0;
+        for (int l = 0; l < count; ++l)
+            word |= ((values[l] >> i) & 1) << l;
+        setLanes(vc[i], word);
+    }
+}
+
+void NetlistJit::getLanes(LogicalVector vc, uint64_t *values, int count) const
+{
+    if (count < 0 || count > UnitBuilder::LANES || vc.length > 64)
+        throw "Out of range";
+    for (int l = 0; l < count; ++l)
+        values[l] = 0;
+    for (int i = 0; i < vc.length; ++i) {
+        uint64_t word = getLanes(vc[i]);
+        for (int l = 0; l < count; ++l)
+            values[l] |= ((word >> l) & 1) << i;
+    }
+}
+
+int NetlistJit::compare(UnitBuilder &builder, int rounds)
+{
+    if (builder.count() != length)
+        throw "Invalid";
+    std::mt19937_64 rng(length);
+    std::vector<uint64_t> before(length);
+    int errors = 0;
+    for (int r = 0; r < rounds; ++r) {
+        for (int i = 0; i < length; ++i) {
+            if (opcodes[i] == GateOpcode::Fix || opcodes[i] == GateOpcode::Clk)
+                words[i] = rng();
+        }
+        before = words;
+        tick();
+        for (int l = 0; l < UnitBuilder::LANES; ++l) {
+            for (int i = 0; i < length; ++i)
+                builder.set(i, (before[i] >> l) & 1);
+            builder.tick();
+            for (int i = 0; i < length; ++i) {
+                if (builder.get(i) != (bool)((words[i] >> l) & 1))
+                    errors++;
+            }
+        }
+    }
+    return errors;
+}
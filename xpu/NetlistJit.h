@@ -0,0 +1,59 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include "UnitBuilder.h"
+
+// Compile a finished UnitBuilder into straight-line x86-64 code. Each gate
+// is a 64-bit word (64 independent stimulus lanes, as UnitBuilder::tickLanes)
+// and the generated code keeps live words in registers. When the host is
+// not x86-64, the executable buffer can't be mapped, or the netlist holds
+// gates the code generator doesn't handle (RS, Maj3, Lut4), the interpreter
+// is used.
+class NetlistJit
+{
+private:
+    int length;
+    std::vector<GateOpcode> opcodes;
+    std::vector<int> pins1;
+    std::vector<int> pins2;
+    std::vector<int> pins3;
+    std::vector<int> pins4;
+    std::vector<uint16_t> tables;
+    std::vector<uint64_t> words;
+    std::map<std::string, LogicalVector> vectors;
+
+    void *code;
+    size_t codeSize;
+    void (*entry)(uint64_t *);
+
+    bool generate(std::vector<uint8_t> &buf);
+    void interpret();
+public:
+    NetlistJit(const UnitBuilder &builder);
+    ~NetlistJit();
+
+    bool compiled() const { return entry != nullptr; }
+    size_t size() const { return codeSize; }
+    LogicalVector operator[](const std::string &name) const
+    {
+        auto it = vectors.find(name);
+        if (it == vectors.end())
+            throw "Undefined";
+        return it->second;
+    }
+
+    void tick();
+    void tickInterpreted() { interpret(); }
+
+    void setLanes(int idx, uint64_t lanes);
+    uint64_t getLanes(int idx) const;
+    void setLanes(LogicalVector vc, const uint64_t *values, int count = UnitBuilder::LANES);
+    void getLanes(LogicalVector vc, uint64_t *values, int count = UnitBuilder::LANES) const;
+
+    // Differential check against UnitBuilder::tick(), every lane of a pass
+    // is replayed on the builder from the same state. Returns the number of
+    // gate values that differ.
+    int compare(UnitBuilder &builder, int rounds);
+};
@@ -0,0 +1,272 @@
+#include "NetlistWide.h"
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define XPU_SIMD
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define XPU_TARGET(x)
+#else
+#define XPU_TARGET(x) __attribute__((target(x)))
+#endif
+
+// RS latches need rand(), they are done word by word in every kernel
+static void wideRS(uint64_t *d, const uint64_t *r, const uint64_t *s, int stride)
+{
+    for (int k = 0; k < stride; ++k) {
+        uint64_t unstable = r[k] & s[k];
+        uint64_t noise = ((uint64_t)rand() << 48) ^ ((uint64_t)rand() << 32) ^ ((uint64_t)rand() << 16) ^ rand();
+        d[k] = (d[k] & ~(r[k] & ~s[k])) | (~r[k] & s[k]);
+        d[k] = (d[k] & ~unstable) | (noise & unstable); // Instable
+    }
+}
+
+// Lut4 is a mux tree on each word, no vector form is worth it
+static void wideLut(uint64_t *d, uint16_t table, const uint64_t *a, const uint64_t *b,
+    const uint64_t *c, const uint64_t *e, int stride)
+{
+    for (int k = 0; k < stride; ++k)
+        d[k] = lutLanes(table, a[k], b ? b[k] : 0, c ? c[k] : 0, e ? e[k] : 0);
+}
+
+// Same loop for every vector width, the intrinsics have to be expanded in
+// a function carrying the target attribute so they can be inlined.
+#define WIDE_KERNEL(NAME, TARGET, VEC, LOAD, STORE, AND, OR, XOR, ONES) \
+TARGET static void NAME(const GateOpcode *op, const int *p1, const int *p2, const int *p3, const int *p4, \
+    const uint16_t *tables, uint64_t *w, int length, int stride) \
+{ \
+    const int step = sizeof(VEC) / 8; \
+    const VEC ones = ONES; \
+    for (int i = 0; i < length; ++i) { \
+        uint64_t *d = w + (size_t)i * stride; \
+        const uint64_t *a = w + (size_t)(p1[i] < 0 ? 0 : p1[i]) * stride; \
+        const uint64_t *b = w + (size_t)(p2[i] < 0 ? 0 : p2[i]) * stride; \
+        const uint64_t *c = w + (size_t)(p3[i] < 0 ? 0 : p3[i]) * stride; \
+        int k = 0; \
+        switch (op[i]) { \
+        case GateOpcode::Zero: \
+            for (; k < stride; k += step) STORE(d + k, XOR(ones, ones)); \
+            break; \
+        case GateOpcode::One: \
+            for (; k < stride; k += step) STORE(d + k, ones); \
+            break; \
+        case GateOpcode::Clk: \
+            for (; k < stride; k += step) STORE(d + k, XOR(LOAD(d + k), ones)); \
+            break; \
+        case GateOpcode::RS: \
+            wideRS(d, a, b, stride); \
+            break; \
+        case GateOpcode::And: \
+            for (; k < stride; k += step) STORE(d + k, AND(LOAD(a + k), LOAD(b + k))); \
+            break; \
+        case GateOpcode::Or: \
+            for (; k < stride; k += step) STORE(d + k, OR(LOAD(a + k), LOAD(b + k))); \
+            break; \
+        case GateOpcode::Xor: \
+            for (; k < stride; k += step) STORE(d + k, XOR(LOAD(a + k), LOAD(b + k))); \
+            break; \
+        case GateOpcode::Nand: \
+            for (; k < stride; k += step) STORE(d + k, XOR(AND(LOAD(a + k), LOAD(b + k)), ones)); \
+            break; \
+        case GateOpcode::Nor: \
+            for (; k < stride; k += step) STORE(d + k, XOR(OR(LOAD(a + k), LOAD(b + k)), ones)); \
+            break; \
+        case GateOpcode::Not: \
+            for (; k < stride; k += step) STORE(d + k, XOR(LOAD(a + k), ones)); \
+            break; \
+        case GateOpcode::Mux: \
+            for (; k < stride; k += step) \
+                STORE(d + k, XOR(LOAD(b + k), AND(XOR(LOAD(b + k), LOAD(c + k)), LOAD(a + k)))); \
+            break; \
+        case GateOpcode::Maj3: \
+            for (; k < stride; k += step) \
+                STORE(d + k, OR(AND(LOAD(a + k), LOAD(b + k)), AND(LOAD(c + k), OR(LOAD(a + k), LOAD(b + k))))); \
+            break; \
+        case GateOpcode::Lut4: \
+            wideLut(d, tables[i], a, p2[i] < 0 ? nullptr : b, p3[i] < 0 ? nullptr : c, \
+                p4[i] < 0 ? nullptr : w + (size_t)p4[i] * stride, stride); \
+            break; \
+        default: \
+            break; \
+        } \
+    } \
+}
+
+#define SCALAR_LOAD(p) (*(p))
+#define SCALAR_STORE(p, v) (*(p) = (v))
+#define SCALAR_AND(a, b) ((a) & (b))
+#define SCALAR_OR(a, b) ((a) | (b))
+#define SCALAR_XOR(a, b) ((a) ^ (b))
+WIDE_KERNEL(tickScalar, , uint64_t, SCALAR_LOAD, SCALAR_STORE, SCALAR_AND, SCALAR_OR, SCALAR_XOR, ~(uint64_t)0)
+
+#if defined(XPU_SIMD)
+#define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i *)(p))
+#define AVX2_STORE(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+WIDE_KERNEL(tickAvx2, XPU_TARGET("avx2"), __m256i, AVX2_LOAD, AVX2_STORE,
+    _mm256_and_si256, _mm256_or_si256, _mm256_xor_si256, _mm256_set1_epi64x(-1))
+
+#define AVX512_LOAD(p) _mm512_loadu_si512((const void *)(p))
+#define AVX512_STORE(p, v) _mm512_storeu_si512((void *)(p), (v))
+WIDE_KERNEL(tickAvx512, XPU_TARGET("avx512f"), __m512i, AVX512_LOAD, AVX512_STORE,
+    _mm512_and_si512, _mm512_or_si512, _mm512_xor_si512, _mm512_set1_epi64(-1))
+#endif
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+static int kernelWords(WideKernel kernel)
+{
+    switch (kernel) {
+    case WideKernel::Avx2:
+        return 4;
+    case WideKernel::Avx512:
+        return 8;
+    default:
+        return 1;
+    }
+}
+
+WideKernel NetlistWide::detect()
+{
+#if !defined(XPU_SIMD)
+    return WideKernel::Scalar;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return WideKernel::Scalar;
+    __cpuid(info, 1);
+    if ((info[2] & (1 << 27)) == 0) // OSXSAVE
+        return WideKernel::Scalar;
+    unsigned long long xcr = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    if ((xcr & 0xe6) == 0xe6 && (info[1] & (1 << 16)))
+        return WideKernel::Avx512;
+    if ((xcr & 0x6) == 0x6 && (info[1] & (1 << 5)))
+        return WideKernel::Avx2;
+    return WideKernel::Scalar;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return WideKernel::Avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return WideKernel::Avx2;
+    return WideKernel::Scalar;
+#endif
+}
+
+const char *NetlistWide::kernelName(WideKernel kernel)
+{
+    switch (kernel) {
+    case WideKernel::Avx2:
+        return "AVX2";
+    case WideKernel::Avx512:
+        return "AVX-512";
+    default:
+        return "Scalar";
+    }
+}
+
+NetlistWide::NetlistWide(const UnitBuilder &builder, int lanes)
+    : length(builder.count32()), lanes(lanes), stride(lanes / 64),
+    opcodes(length), pins1(length), pins2(length), pins3(length), pins4(length), tables(length), vectors(builder.namedVectors()),
+    kernel(WideKernel::Scalar)
+{
+    if (builder.cellCount() > 0)
+        throw "Unsupported"; // Macro cells only run on UnitBuilder
+    if (lanes <= 0 || lanes % 64 != 0)
+        throw "Invalid";
+    words.assign((size_t)length * stride, 0);
+    for (int i = 0; i < length; ++i) {
+        auto &g = builder.gate(i);
+        opcodes[i] = g.opcode;
+        pins1[i] = g.pin1;
+        pins2[i] = g.pin2;
+        pins3[i] = g.pin3;
+        pins4[i] = g.pin4;
+        tables[i] = g.table;
+        words[(size_t)i * stride] = g.lanes;
+    }
+
+    // Widest vector the CPU has that still divides a gate
+    WideKernel best = detect();
+    while (best != WideKernel::Scalar && stride % kernelWords(best) != 0)
+        best = best == WideKernel::Avx512 ? WideKernel::Avx2 : WideKernel::Scalar;
+    kernel = best;
+}
+
+void NetlistWide::useKernel(WideKernel wanted)
+{
+    if (wanted != WideKernel::Scalar) {
+        WideKernel cpu = detect();
+        if (kernelWords(cpu) < kernelWords(wanted) || stride % kernelWords(wanted) != 0)
+            throw "Unsupported";
+    }
+    kernel = wanted;
+}
+
+void NetlistWide::tick()
+{
+    switch (kernel) {
+#if defined(XPU_SIMD)
+    case WideKernel::Avx512:
+        tickAvx512(opcodes.data(), pins1.data(), pins2.data(), pins3.data(), pins4.data(), tables.data(),
+            words.data(), length, stride);
+        break;
+    case WideKernel::Avx2:
+        tickAvx2(opcodes.data(), pins1.data(), pins2.data(), pins3.data(), pins4.data(), tables.data(),
+            words.data(), length, stride);
+        break;
+#endif
+    default:
+        tickScalar(opcodes.data(), pins1.data(), pins2.data(), pins3.data(), pins4.data(), tables.data(),
+            words.data(), length, stride);
+        break;
+    }
+}
+
+void NetlistWide::setLanes(int idx, const uint64_t *value)
+{
+    if (idx < 0 || idx >= length)
+        return;
+    for (int k = 0; k < stride; ++k)
+        words[(size_t)idx * stride + k] = value[k];
+}
+
+void NetlistWide::getLanes(int idx, uint64_t *value) const
+{
+    for (int k = 0; k < stride; ++k)
+        value[k] = idx < 0 || idx >= length ? 0 : words[(size_t)idx * stride + k];
+}
+
+void NetlistWide::setLanes(LogicalVector vc, const uint64_t *values, int count)
+{
+    if (count < 0 || count > lanes || vc.length > 64)
+        throw "Out of range";
+    std::vector<uint64_t> word(stride);
+    for (int i = 0; i < vc.length; ++i) {
+        for (int k = 0; k < stride; ++k)
+            word[k] = 0;
+        for (int l = 0; l < count; ++l)
+            word[l >> 6] |= ((values[l] >> i) & 1) << (l & 63);
+        setLanes(vc[i], word.data());
+    }
+}
+
+void NetlistWide::getLanes(LogicalVector vc, uint64_t *values, int count) const
+{
+    if (count < 0 || count > lanes || vc.length > 64)
+        throw "Out of range";
+    std::vector<uint64_t> word(stride);
+    for (int l = 0; l < count; ++l)
+        values[l] = 0;
+    for (int i = 0; i < vc.length; ++i) {
+        getLanes(vc[i], word.data());
+        for (int l = 0; l < count; ++l)
+            values[l] |= ((word[l >> 6] >> (l & 63)) & 1) << i;
+    }
+}
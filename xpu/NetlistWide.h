@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include "UnitBuilder.h"
+
+enum class WideKernel
+{
+    Scalar,
+    Avx2,
+    Avx512,
+};
+
+// Bit-parallel simulation over more than 64 lanes, each gate holds
+// lanes / 64 words evaluated with the same semantics as
+// UnitBuilder::tickLanes. The widest kernel supported by the CPU is picked
+// at runtime, with a portable scalar kernel as fallback.
+class NetlistWide
+{
+private:
+    int length;
+    int lanes;
+    int stride;
+    std::vector<GateOpcode> opcodes;
+    std::vector<int> pins1;
+    std::vector<int> pins2;
+    std::vector<int> pins3;
+    std::vector<int> pins4;
+    std::vector<uint16_t> tables;
+    std::vector<uint64_t> words;
+    std::map<std::string, LogicalVector> vectors;
+    WideKernel kernel;
+public:
+    NetlistWide(const UnitBuilder &builder, int lanes = 512);
+
+    static WideKernel detect();
+    static const char *kernelName(WideKernel kernel);
+    WideKernel currentKernel() const { return kernel; }
+    // Force a kernel, throws if the CPU or the lane count can't use it
+    void useKernel(WideKernel kernel);
+
+    int size() const { return length; }
+    int laneCount() const { return lanes; }
+    LogicalVector operator[](const std::string &name) const
+    {
+        auto it = vectors.find(name);
+        if (it == vectors.end())
+            throw "Undefined";
+        return it->second;
+    }
+
+    void tick();
+
+    // Raw access to the lanes / 64 words of a gate
+    void setLanes(int idx, const uint64_t *value);
+    void getLanes(int idx, uint64_t *value) const;
+    // One operand set per lane, at most laneCount() values
+    void setLanes(LogicalVector vc, const uint64_t *values, int count);
+    void getLanes(LogicalVector vc, uint64_t *values, int count) const;
+};
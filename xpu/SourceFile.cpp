@@ -0,0 +1,86 @@
+#include "SourceFile.h"
+#include <fstream>
+#include <sstream>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SourceFile::SourceFile(const std::string &path)
+    : path(path), data(""), size(0), view(nullptr)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        throw "Unable to open";
+    LARGE_INTEGER length;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        if (view != nullptr) {
+            data = (const char *)view;
+            size = (size_t)length.QuadPart;
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw "Unable to open";
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            view = ptr;
+            data = (const char *)ptr;
+            size = (size_t)st.st_size;
+        }
+    }
+    close(fd);
+#endif
+    if (view != nullptr)
+        return;
+
+    // Pipes and other files without a size
+    std::ifstream rd(path, std::ios::in | std::ios::binary);
+    std::ostringstream ss;
+    ss << rd.rdbuf();
+    copy = ss.str();
+    data = copy.c_str();
+    size = copy.size();
+}
+
+SourceFile::~SourceFile()
+{
+    if (view == nullptr)
+        return;
+#if defined(_WIN32)
+    UnmapViewOfFile(view);
+#else
+    munmap(view, size);
+#endif
+}
+
+void SourceFile::position(const char *ptr, int &line, int &column) const
+{
+    line = 1;
+    column = 1;
+    if (!contains(ptr))
+        return;
+    for (const char *p = data; p < ptr; ++p) {
+        if (*p == '\n') {
+            line++;
+            column = 1;
+        } else {
+            column++;
+        }
+    }
+}
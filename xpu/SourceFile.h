@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// File mapped read-only, the parser keeps views into it instead of copies.
+// Files that can't be mapped are read in memory.
+class SourceFile
+{
+private:
+    std::string path;
+    const char *data;
+    size_t size;
+    void *view;
+    std::string copy;
+public:
+    SourceFile(const std::string &path);
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+    ~SourceFile();
+
+    const std::string &name() const { return path; }
+    std::string_view text() const { return std::string_view(data, size); }
+    bool contains(const char *ptr) const { return ptr >= data && ptr <= data + size; }
+    // Line and column of a character of text(), both from 1
+    void position(const char *ptr, int &line, int &column) const;
+};
@@ -0,0 +1,44 @@
+#include "SymbolTable.h"
+
+// FNV-1a
+uint32_t SymbolTable::hash(std::string_view name)
+{
+    uint32_t h = 2166136261u;
+    for (char ch : name)
+        h = (h ^ (unsigned char)ch) * 16777619u;
+    return h;
+}
+
+size_t SymbolTable::slot(std::string_view name, uint32_t h) const
+{
+    size_t mask = slots.size() - 1;
+    for (size_t k = h & mask; ; k = (k + 1) & mask) {
+        SymbolId id = slots[k];
+        if (id < 0 || (hashes[id] == h && names[id] == name))
+            return k;
+    }
+}
+
+SymbolId SymbolTable::find(std::string_view name) const
+{
+    if (slots.empty())
+        return -1;
+    return slots[slot(name, hash(name))];
+}
+
+SymbolId SymbolTable::insert(std::string_view name)
+{
+    uint32_t h = hash(name);
+    if ((names.size() + 1) * 2 > slots.size()) {
+        slots.assign(slots.empty() ? 64 : slots.size() * 2, -1);
+        for (SymbolId id = 0; id < (SymbolId)names.size(); ++id)
+            slots[slot(names[id], hashes[id])] = id;
+    }
+    size_t k = slot(name, h);
+    if (slots[k] >= 0)
+        return slots[k];
+    slots[k] = (SymbolId)names.size();
+    names.emplace_back(name);
+    hashes.push_back(h);
+    return slots[k];
+}
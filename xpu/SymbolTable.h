@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+typedef int SymbolId;
+
+// Names interned once, the parser keeps their index instead of the text.
+// Open addressing on the hash of the name, the slots hold the indexes.
+class SymbolTable
+{
+private:
+    std::vector<std::string> names;
+    std::vector<uint32_t> hashes;
+    std::vector<SymbolId> slots;
+
+    static uint32_t hash(std::string_view name);
+    size_t slot(std::string_view name, uint32_t h) const;
+public:
+    // -1 if the name was never inserted
+    SymbolId find(std::string_view name) const;
+    // Index of the name, added if it is new
+    SymbolId insert(std::string_view name);
+    const std::string &name(SymbolId id) const { return names[id]; }
+    size_t size() const { return names.size(); }
+};
@@ -0,0 +1,118 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int count)
+    : job(nullptr), generation(0), remaining(0), busy(0), stopping(false)
+{
+    if (count < 1)
+        count = 1;
+    for (int i = 0; i < count; ++i)
+        queues.emplace_back(new WorkQueue());
+    // Queue zero belongs to the thread calling run()
+    for (int i = 1; i < count; ++i)
+        threads.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &th : threads)
+        th.join();
+}
+
+bool ThreadPool::next(int self, int &task)
+{
+    {
+        auto &own = *queues[self];
+        std::unique_lock<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (int i = 1, n = size(); i < n; ++i) {
+        auto &other = *queues[(self + i) % n];
+        std::unique_lock<std::mutex> guard(other.lock);
+        if (!other.tasks.empty()) {
+            task = other.tasks.front();
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::drain(int self)
+{
+    int task;
+    while (next(self, task)) {
+        try {
+            (*job)(task);
+        } catch (...) {
+            std::unique_lock<std::mutex> guard(lock);
+            if (!failure)
+                failure = std::current_exception();
+        }
+        remaining--;
+    }
+}
+
+void ThreadPool::work(int self)
+{
+    unsigned seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            busy++;
+        }
+        drain(self);
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            busy--;
+        }
+        done.notify_all();
+    }
+}
+
+void ThreadPool::run(int count, const std::function<void(int)> &task)
+{
+    if (count <= 0)
+        return;
+    if (threads.empty()) {
+        for (int i = 0; i < count; ++i)
+            task(i);
+        return;
+    }
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        job = &task;
+        remaining = count;
+        for (int i = 0, n = size(); i < count; ++i) {
+            auto &queue = *queues[i % n];
+            std::unique_lock<std::mutex> qguard(queue.lock);
+            queue.tasks.push_back(i);
+        }
+        generation++;
+    }
+    wake.notify_all();
+    drain(0);
+
+    // Wait for stolen tasks to finish and for every worker to leave the batch
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&] { return remaining == 0 && busy == 0; });
+    job = nullptr;
+    if (failure) {
+        std::exception_ptr first = failure;
+        failure = nullptr;
+        std::rethrow_exception(first);
+    }
+}
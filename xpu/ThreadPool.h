@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent pool of workers. run() hands a batch of task indices out in
+// per-worker queues, idle workers steal from the others, and the call
+// returns once the whole batch is done (a barrier). The first exception
+// thrown by a task is rethrown by run() on the calling thread.
+class ThreadPool
+{
+private:
+    struct WorkQueue
+    {
+        std::mutex lock;
+        std::deque<int> tasks;
+    };
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int)> *job;
+    std::exception_ptr failure;
+    unsigned generation;
+    std::atomic<int> remaining;
+    int busy;
+    bool stopping;
+
+    void work(int self);
+    bool next(int self, int &task);
+    void drain(int self);
+public:
+    ThreadPool(int count = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    // Worker count, the calling thread included
+    int size() const { return (int)queues.size(); }
+    void run(int count, const std::function<void(int)> &task);
+};
@@ -1,10 +1,14 @@
 #include "UnitBuilder.h"
 #include <iostream>
 #include <fstream>
+#include <array>
 #include <vector>
+#include <limits>
+#include <cstdlib>
 #include "Expression.h"
 
 const int NO_PIN = -1;
+static const TriLanes TriX = { ~(uint64_t)0, ~(uint64_t)0 };
 
 const char *OpcodeNames[] = {
     "Zero",
@@ -20,26 +24,163 @@ const char *OpcodeNames[] = {
     "Not",
     "In",
     "Out",
+    "Reg",
+    "Ram",
+    "Rom",
+    "Mux",
+    "Maj3",
+    "Lut4",
 };
 
-UnitBuilder::UnitBuilder(int size)
+UnitBuilder::UnitBuilder(GateId reserve)
 {
-    board = new LogicalGate[size];
-    length = size;
+    board.reserve((size_t)reserve);
     pen = 0;
+    maxUsage = 0;
+    maxDepth = 0;
+    hashing = false;
+    hashCount = 0;
+    cellsBound = true;
+    coneValid = false;
+    incremental = false;
+    settled = false;
+    skipped = 0;
+    xmode = false;
 }
 
 UnitBuilder::~UnitBuilder()
 {
-    delete[]board;
 }
 
-int UnitBuilder::addGate(GateOpcode opcode, int pin1, int pin2)
+bool UnitBuilder::isHashable(GateOpcode opcode)
 {
-    if (pen + 1 >= length)
+    switch (opcode) {
+    case GateOpcode::Zero:
+    case GateOpcode::One:
+    case GateOpcode::And:
+    case GateOpcode::Or:
+    case GateOpcode::Xor:
+    case GateOpcode::Nand:
+    case GateOpcode::Nor:
+    case GateOpcode::Not:
+    case GateOpcode::Mux:
+    case GateOpcode::Maj3:
+    case GateOpcode::Lut4:
+        return true;
+    default:
+        return false; // Inputs and stateful gates are always distinct
+    }
+}
+
+// First slot holding the same gate, or the empty slot ending the probe
+size_t UnitBuilder::hashSlot(const LogicalGate &key) const
+{
+    uint64_t h = (uint64_t)(uint32_t)key.pin1 * 0x9E3779B97F4A7C15ULL;
+    h ^= ((uint64_t)(uint32_t)key.pin2 + ((uint64_t)key.opcode << 32)) * 0xC2B2AE3D27D4EB4FULL;
+    h ^= ((uint64_t)(uint32_t)key.pin3 + ((uint64_t)key.table << 32)) * 0x165667B19E3779F9ULL;
+    h ^= (uint64_t)(uint32_t)key.pin4 * 0x27D4EB2F165667C5ULL;
+    h ^= h >> 29;
+    size_t mask = hashSlots.size() - 1;
+    for (size_t k = h & mask; ; k = (k + 1) & mask) {
+        GateId idx = hashSlots[k];
+        if (idx < 0)
+            return k;
+        auto &g = board[idx];
+        if (g.opcode == key.opcode && g.pin1 == key.pin1 && g.pin2 == key.pin2
+            && g.pin3 == key.pin3 && g.pin4 == key.pin4 && g.table == key.table)
+            return k;
+    }
+}
+
+void UnitBuilder::hashInsert(GateId idx)
+{
+    if ((hashCount + 1) * 2 > hashSlots.size()) {
+        std::vector<GateId> old;
+        old.swap(hashSlots);
+        hashSlots.assign(old.empty() ? 1024 : old.size() * 2, -1);
+        hashCount = 0;
+        for (GateId k : old) {
+            if (k >= 0) {
+                hashSlots[hashSlot(board[k])] = k;
+                hashCount++;
+            }
+        }
+    }
+    size_t k = hashSlot(board[idx]);
+    if (hashSlots[k] < 0) {
+        hashSlots[k] = idx;
+        hashCount++;
+    }
+}
+
+void UnitBuilder::setHashing(bool enable)
+{
+    hashing = enable;
+    hashSlots.clear();
+    hashCount = 0;
+    if (!enable)
+        return;
+    for (GateId i = 0; i < pen; ++i) {
+        if (isHashable(board[i].opcode))
+            hashInsert(i);
+    }
+}
+
+// Commutative inputs are sorted
+static void sortPins(GateOpcode opcode, GateId &pin1, GateId &pin2, GateId &pin3)
+{
+    if (opcode == GateOpcode::Maj3) {
+        if (pin1 > pin2)
+            std::swap(pin1, pin2);
+        if (pin2 > pin3)
+            std::swap(pin2, pin3);
+        if (pin1 > pin2)
+            std::swap(pin1, pin2);
+    } else if (opcode != GateOpcode::Not && opcode != GateOpcode::Mux && opcode != GateOpcode::Lut4 && pin1 > pin2) {
+        std::swap(pin1, pin2);
+    }
+}
+
+GateId UnitBuilder::findGate(GateOpcode opcode, GateId pin1, GateId pin2, GateId pin3) const
+{
+    if (!hashing || !isHashable(opcode) || hashSlots.empty())
+        return -1;
+    sortPins(opcode, pin1, pin2, pin3);
+    LogicalGate key;
+    key.opcode = opcode;
+    key.pin1 = pin1;
+    key.pin2 = pin2;
+    key.pin3 = pin3;
+    key.pin4 = -1;
+    key.table = 0;
+    return hashSlots[hashSlot(key)];
+}
+
+GateId UnitBuilder::addGate(GateOpcode opcode, GateId pin1, GateId pin2, GateId pin3, GateId pin4, uint16_t table)
+{
+    if (hashing && isHashable(opcode)) {
+        sortPins(opcode, pin1, pin2, pin3);
+        if (!hashSlots.empty()) {
+            LogicalGate key;
+            key.opcode = opcode;
+            key.pin1 = pin1;
+            key.pin2 = pin2;
+            key.pin3 = pin3;
+            key.pin4 = pin4;
+            key.table = table;
+            GateId idx = hashSlots[hashSlot(key)];
+            if (idx >= 0)
+                return idx;
+        }
+    }
+    if (pen == std::numeric_limits<GateId>::max())
         throw "Out of gates";
-    if (pin1 >= pen || pin2 >= pen)
-        throw "Invalid";
+    board.reserve((size_t)pen + 1);
+    GateId pins[4] = { pin1, pin2, pin3, pin4 };
+    for (GateId pin : pins) {
+        if (pin >= pen)
+            throw "Invalid";
+    }
 
     bool valid = true;
     switch (opcode) {
@@ -52,42 +193,49 @@ int UnitBuilder::addGate(GateOpcode opcode, int pin1, int pin2)
         valid = pin1 >= 0 && pin2 >= 0;
         break;
     case GateOpcode::Not:
+    case GateOpcode::Lut4:
         valid = pin1 >= 0;
         break;
-    case GateOpcode::In:
+    case GateOpcode::Mux:
+    case GateOpcode::Maj3:
+        valid = pin1 >= 0 && pin2 >= 0 && pin3 >= 0;
         break;
-    case GateOpcode::Out:
+    default:
         break;
     }
     if (!valid)
         throw "Invalid";
 
-    board[pen].pin1 = pin1;
-    board[pen].pin2 = pin2;
-    board[pen].opcode = opcode;
-    board[pen].value = false;
-    board[pen].depth = 0;
-    board[pen].usage = 0;
-    if (pin1 >= 0) {
-        board[pin1].usage++;
-        if (board[pin1].usage > maxUsage)
-            maxUsage = board[pin1].usage;
-        if (board[pin1].depth >= board[pen].depth)
-            board[pen].depth = board[pin1].depth + 1;
-    }
-    if (pin2 >= 0) {
-        board[pin2].usage++;
-        if (board[pin2].usage > maxUsage)
-            maxUsage = board[pin2].usage;
-        if (board[pin2].depth >= board[pen].depth)
-            board[pen].depth = board[pin2].depth + 1;
-    }
-    if (board[pen].depth > maxDepth)
-        maxDepth = board[pen].depth;
+    auto &g = board[pen];
+    g.pin1 = pin1;
+    g.pin2 = pin2;
+    g.pin3 = pin3;
+    g.pin4 = pin4;
+    g.table = table;
+    g.opcode = opcode;
+    g.value = false;
+    g.lanes = 0;
+    g.depth = 0;
+    g.usage = 0;
+    for (GateId pin : pins) {
+        if (pin < 0)
+            continue;
+        board[pin].usage++;
+        if (board[pin].usage > maxUsage)
+            maxUsage = board[pin].usage;
+        if (board[pin].depth >= g.depth)
+            g.depth = board[pin].depth + 1;
+    }
+    if (g.depth > maxDepth)
+        maxDepth = g.depth;
+    if (hashing && isHashable(opcode))
+        hashInsert(pen);
+    coneValid = false;
+    settled = false;
     return pen++;
 }
 
-LogicalVector UnitBuilder::addGate(GateOpcode opcode, const std::string pins1, int pin2)
+LogicalVector UnitBuilder::addGate(GateOpcode opcode, const std::string pins1, GateId pin2)
 {
     return addGate(opcode, vectors[pins1], pin2);
 }
@@ -97,62 +245,422 @@ LogicalVector UnitBuilder::addGate(GateOpcode opcode, const std::string pins1, c
     return addGate(opcode, vectors[pins1], vectors[pins2]);
 }
 
-LogicalVector UnitBuilder::addGate(GateOpcode opcode, LogicalVector vc1, int pin2)
+LogicalVector UnitBuilder::addGate(GateOpcode opcode, const LogicalVector &vc1, GateId pin2)
 {
-    LogicalVector rs(pen, vc1.length);
+    LogicalVector rs(vc1.length);
     for (int i = 0; i < vc1.length; ++i)
-        addGate(opcode, vc1[i], +pin2);
+        rs.set(i, addGate(opcode, vc1[i], +pin2));
+    rs.pack();
     return rs;
 }
 
-LogicalVector UnitBuilder::addGate(GateOpcode opcode, LogicalVector vc1, LogicalVector vc2)
+LogicalVector UnitBuilder::addGate(GateOpcode opcode, const LogicalVector &vc1, const LogicalVector &vc2)
 {
     if (vc1.length == 1)
         return addGate(opcode, vc2, vc1[0]);
     if (vc2.length == 1)
         return addGate(opcode, vc1, vc2[0]);
-    LogicalVector rs(pen, vc1.length);
+    LogicalVector rs(vc1.length);
     if (vc1.length != vc2.length)
         throw "Invalid";
     for (int i = 0; i < vc1.length; ++i)
-        addGate(opcode, vc1[ i], vc2[i]);
+        rs.set(i, addGate(opcode, vc1[ i], vc2[i]));
+    rs.pack();
     return rs;
 }
 
-LogicalVector UnitBuilder::addGate(GateOpcode opcode, const std::string pins1, LogicalVector vc2)
+LogicalVector UnitBuilder::addGate(GateOpcode opcode, const std::string pins1, const LogicalVector &vc2)
 {
     return addGate(opcode, vectors[pins1], vc2);
 }
 
-LogicalVector UnitBuilder::addSelect(int idx, LogicalVector vc1, LogicalVector vc2)
+LogicalVector UnitBuilder::addSelect(GateId idx, const LogicalVector &vc1, const LogicalVector &vc2)
 {
     if (vc1.length != vc2.length)
         throw "Invalid";
-    return addGate(GateOpcode::Or,
-        addGate(GateOpcode::And,
-        vc1,
-        addGate(GateOpcode::Not, idx)
-    ),
-        addGate(GateOpcode::And,
-        vc2,
-        idx)
-    );
+    LogicalVector rs(vc1.length);
+    for (int i = 0; i < vc1.length; ++i)
+        rs.set(i, addGate(GateOpcode::Mux, idx, vc1[i], vc2[i]));
+    rs.pack();
+    return rs;
 }
 
-LogicalVector UnitBuilder::addSelect(int idx, int pin1, int pin2)
+LogicalVector UnitBuilder::addSelect(GateId idx, GateId pin1, GateId pin2)
 {
-    return addGate(GateOpcode::Or,
-        addGate(GateOpcode::And,
-        pin1,
-        addGate(GateOpcode::Not, idx)
-    ),
-        addGate(GateOpcode::And,
-        pin2,
-        idx)
-    );
+    return LogicalVector(addGate(GateOpcode::Mux, idx, pin1, pin2), 1);
 }
 
-int UnitBuilder::addGateSum(GateOpcode opcode, LogicalVector vc)
+// Lowers a SELECT bit by bit, adding the gates or only planning them. A
+// plan finds the gates already on the board through the hash and numbers
+// the new ones from -2 down, sharing them as hashing would.
+class SelectEmit
+{
+private:
+    UnitBuilder &builder;
+    bool dry;
+    // Open addressing on the planned gates, slots hold their ids
+    std::vector<std::array<GateId, 4>> keys;
+    std::vector<GateId> slots;
+    std::vector<int> depths;
+
+    GateId &plannedSlot(const std::array<GateId, 4> &key)
+    {
+        if ((keys.size() + 1) * 2 > slots.size()) {
+            slots.assign(slots.empty() ? 256 : slots.size() * 2, 0);
+            for (size_t k = 0; k < keys.size(); ++k)
+                plannedSlot(keys[k]) = -2 - (GateId)k;
+        }
+        uint64_t h = (uint64_t)(uint32_t)key[1] * 0x9E3779B97F4A7C15ULL;
+        h ^= ((uint64_t)(uint32_t)key[2] + ((uint64_t)key[0] << 32)) * 0xC2B2AE3D27D4EB4FULL;
+        h ^= (uint64_t)(uint32_t)key[3] * 0x165667B19E3779F9ULL;
+        h ^= h >> 29;
+        size_t mask = slots.size() - 1;
+        for (size_t k = h & mask; ; k = (k + 1) & mask) {
+            if (slots[k] == 0 || keys[-2 - slots[k]] == key)
+                return slots[k];
+        }
+    }
+public:
+    GateId gates;
+    int depth;
+
+    SelectEmit(UnitBuilder &builder, bool dry) : builder(builder), dry(dry), gates(0), depth(0) {}
+
+    int depthOf(GateId idx) const
+    {
+        return idx >= 0 ? builder.board[idx].depth : depths[-2 - idx];
+    }
+
+    GateId gate(GateOpcode opcode, GateId pin1, GateId pin2 = -1, GateId pin3 = -1)
+    {
+        if (!dry)
+            return builder.addGate(opcode, pin1, pin2, pin3);
+        if (pin1 >= -1 && pin2 >= -1 && pin3 >= -1) {
+            GateId idx = builder.findGate(opcode, pin1, pin2, pin3);
+            if (idx >= 0)
+                return idx;
+        }
+        sortPins(opcode, pin1, pin2, pin3);
+        std::array<GateId, 4> key{ (GateId)opcode, pin1, pin2, pin3 };
+        auto &slot = plannedSlot(key);
+        if (slot == 0) {
+            int d = 0;
+            for (GateId pin : { pin1, pin2, pin3 }) {
+                if (pin != -1)
+                    d = std::max(d, depthOf(pin) + 1);
+            }
+            slot = -2 - (GateId)keys.size();
+            keys.push_back(key);
+            depths.push_back(d);
+            gates++;
+        }
+        return slot;
+    }
+
+    // Balanced like addGateSum()
+    GateId sum(GateOpcode opcode, const std::vector<GateId> &pins, size_t from, size_t to)
+    {
+        if (to - from == 1)
+            return pins[from];
+        if (to - from == 2)
+            return gate(opcode, pins[from], pins[from + 1]);
+        size_t k = from + (to - from - 1) / 2;
+        GateId i1 = sum(opcode, pins, from, k + 1);
+        GateId i2 = sum(opcode, pins, k + 1, to);
+        return gate(opcode, i1, i2);
+    }
+
+    // Selector bit j picks between the entries k and k + 2^j
+    GateId muxTree(const LogicalVector &sel, std::vector<GateId> ids)
+    {
+        for (int j = 0; ids.size() > 1; ++j) {
+            for (size_t i = 0; i < ids.size(); i += 2)
+                ids[i / 2] = ids[i] == ids[i + 1] ? ids[i] : gate(GateOpcode::Mux, sel[j], ids[i], ids[i + 1]);
+            ids.resize(ids.size() / 2);
+        }
+        return ids[0];
+    }
+
+    std::vector<GateId> decoder(const LogicalVector &sel)
+    {
+        std::vector<GateId> key(sel.length);
+        for (int j = 0; j < sel.length; ++j)
+            key[j] = sel[j];
+        auto it = builder.decoders.find(key);
+        if (it != builder.decoders.end())
+            return it->second;
+        std::vector<GateId> terms{ gate(GateOpcode::Not, sel[0]), sel[0] };
+        for (int j = 1; j < sel.length; ++j) {
+            GateId inv = gate(GateOpcode::Not, sel[j]);
+            size_t n = terms.size();
+            terms.resize(n * 2);
+            for (size_t k = 0; k < n; ++k) {
+                terms[k + n] = gate(GateOpcode::And, terms[k], sel[j]);
+                terms[k] = gate(GateOpcode::And, terms[k], inv);
+            }
+        }
+        if (!dry)
+            builder.decoders[key] = terms;
+        return terms;
+    }
+
+    // Entries reading the same gate share the OR of their terms, Zero
+    // entries are left out and One entries need no AND
+    GateId plane(const std::vector<GateId> &terms, const std::vector<GateId> &ids)
+    {
+        std::vector<GateId> data;
+        std::vector<std::vector<GateId>> groups;
+        for (size_t k = 0; k < ids.size(); ++k) {
+            if (builder.board[ids[k]].opcode == GateOpcode::Zero)
+                continue;
+            size_t g = std::find(data.begin(), data.end(), ids[k]) - data.begin();
+            if (g == data.size()) {
+                data.push_back(ids[k]);
+                groups.emplace_back();
+            }
+            groups[g].push_back(terms[k]);
+        }
+        if (data.empty())
+            return ids[0];
+        std::vector<GateId> products;
+        for (size_t g = 0; g < data.size(); ++g) {
+            GateId term = sum(GateOpcode::Or, groups[g], 0, groups[g].size());
+            if (builder.board[data[g]].opcode == GateOpcode::One)
+                products.push_back(term);
+            else
+                products.push_back(gate(GateOpcode::And, term, data[g]));
+        }
+        return sum(GateOpcode::Or, products, 0, products.size());
+    }
+
+    LogicalVector lower(const LogicalVector &sel, const std::vector<LogicalVector> &entries, bool decode)
+    {
+        std::vector<GateId> terms;
+        if (decode)
+            terms = decoder(sel);
+        int width = entries[0].length;
+        LogicalVector rs(width);
+        std::vector<GateId> ids(entries.size());
+        for (int i = 0; i < width; ++i) {
+            bool same = true;
+            for (size_t k = 0; k < entries.size(); ++k) {
+                ids[k] = entries[k][i];
+                same = same && ids[k] == ids[0];
+            }
+            GateId out = same ? ids[0] : (decode ? plane(terms, ids) : muxTree(sel, ids));
+            depth = std::max(depth, depthOf(out));
+            if (!dry)
+                rs.set(i, out);
+        }
+        rs.pack();
+        return rs;
+    }
+};
+
+LogicalVector UnitBuilder::addSelect(const LogicalVector &sel, const std::vector<LogicalVector> &entries)
+{
+    if (sel.length == 0 || entries.size() != (size_t)1 << sel.length)
+        throw "Incorrect";
+    for (int j = 0; j < sel.length; ++j) {
+        if (sel[j] < 0)
+            throw "Undefined";
+    }
+    for (auto &vc : entries) {
+        if (vc.length != entries[0].length)
+            throw "Invalid";
+        for (int i = 0; i < vc.length; ++i) {
+            if (vc[i] < 0)
+                throw "Undefined";
+        }
+    }
+    SelectEmit mux(*this, true);
+    mux.lower(sel, entries, false);
+
+    // Without a decoder on sel none of the plane is on the board yet, it
+    // needs at least an OR per data gate but one and an AND per non One
+    bool decode = false;
+    if (mux.gates > 0) {
+        GateId bound = 0;
+        std::vector<GateId> key(sel.length);
+        for (int j = 0; j < sel.length; ++j)
+            key[j] = sel[j];
+        if (decoders.find(key) == decoders.end()) {
+            std::vector<GateId> data;
+            for (int i = 0; i < entries[0].length; ++i) {
+                data.clear();
+                bool same = true;
+                for (auto &vc : entries) {
+                    same = same && vc[i] == entries[0][i];
+                    if (board[vc[i]].opcode != GateOpcode::Zero && std::find(data.begin(), data.end(), vc[i]) == data.end())
+                        data.push_back(vc[i]);
+                }
+                if (same || data.empty())
+                    continue;
+                for (GateId idx : data)
+                    bound += board[idx].opcode == GateOpcode::One ? 1 : 2;
+                bound--;
+            }
+        }
+        if (bound < mux.gates) {
+            SelectEmit plane(*this, true);
+            plane.lower(sel, entries, true);
+            decode = plane.gates < mux.gates || (plane.gates == mux.gates && plane.depth < mux.depth);
+        }
+    }
+    SelectEmit emit(*this, false);
+    return emit.lower(sel, entries, decode);
+}
+
+// Generate and propagate of each bit are merged by a prefix network until
+// the group of every bit reaches bit 0, its generate is then the carry out
+LogicalVector UnitBuilder::addAdd(const LogicalVector &a, const LogicalVector &b, GateId cin,
+    LogicalVector *carries, PrefixNetwork network)
+{
+    int n = a.length;
+    if (n == 0 || b.length != n)
+        throw "Invalid";
+    std::vector<GateId> x(n), g(n), p(n);
+    std::vector<int> low(n);
+    for (int i = 0; i < n; ++i) {
+        x[i] = addGate(GateOpcode::Xor, a[i], b[i]);
+        g[i] = addGate(GateOpcode::And, a[i], b[i]);
+        p[i] = x[i];
+        low[i] = i;
+    }
+    if (cin >= 0)
+        g[0] = addGate(GateOpcode::Or, g[0], addGate(GateOpcode::And, x[0], cin));
+
+    // Group of i over the one of j below it, the propagate is only needed
+    // while the group doesn't reach bit 0
+    auto merge = [&](int i, int j) {
+        g[i] = addGate(GateOpcode::Or, g[i], addGate(GateOpcode::And, p[i], g[j]));
+        if (low[j] > 0)
+            p[i] = addGate(GateOpcode::And, p[i], p[j]);
+        low[i] = low[j];
+    };
+    if (network == PrefixNetwork::KoggeStone) {
+        // Downwards so that i - d still holds the previous level
+        for (int d = 1; d < n; d *= 2) {
+            for (int i = n - 1; i >= d; --i) {
+                if (low[i] > 0)
+                    merge(i, i - d);
+            }
+        }
+    } else {
+        // Tree up to the powers of two, then back down to the other bits
+        int d = 1;
+        for (; d < n; d *= 2) {
+            for (int i = d * 2 - 1; i < n; i += d * 2)
+                merge(i, i - d);
+        }
+        for (d /= 4; d >= 1; d /= 2) {
+            for (int i = d * 3 - 1; i < n; i += d * 2)
+                merge(i, i - d);
+        }
+    }
+
+    LogicalVector rs(n);
+    rs.set(0, cin >= 0 ? addGate(GateOpcode::Xor, x[0], cin) : x[0]);
+    for (int i = 1; i < n; ++i)
+        rs.set(i, addGate(GateOpcode::Xor, x[i], g[i - 1]));
+    rs.pack();
+    if (carries != nullptr) {
+        *carries = LogicalVector(n);
+        for (int i = 0; i < n; ++i)
+            carries->set(i, g[i]);
+        carries->pack();
+    }
+    return rs;
+}
+
+LogicalVector UnitBuilder::addShift(const LogicalVector &x, const LogicalVector &n, ShiftMode mode)
+{
+    int w = x.length;
+    if (w == 0 || n.length == 0)
+        throw "Invalid";
+    bool right = mode == ShiftMode::Shr || mode == ShiftMode::Sar || mode == ShiftMode::Ror;
+    bool rotate = mode == ShiftMode::Rol || mode == ShiftMode::Ror;
+    GateId fill = -1;
+    if (mode == ShiftMode::Sar)
+        fill = x[w - 1];
+    else if (!rotate)
+        fill = addGate(GateOpcode::Zero);
+
+    std::vector<GateId> v(w), next(w);
+    for (int i = 0; i < w; ++i)
+        v[i] = x[i];
+    std::vector<GateId> over;
+    int step = 1 % w; // 2^k, modulo the width for the rotations
+    for (int k = 0; k < n.length; ++k, step = (int)(step * 2LL % w)) {
+        if (!rotate && (k >= 30 || (1 << k) >= w)) {
+            over.push_back(n[k]);
+            continue;
+        }
+        int s = rotate ? step : 1 << k;
+        if (s == 0)
+            continue;
+        for (int i = 0; i < w; ++i) {
+            int from = right ? i + s : i - s;
+            GateId src;
+            if (from >= 0 && from < w)
+                src = v[from];
+            else
+                src = rotate ? v[(from + w) % w] : fill;
+            next[i] = src == v[i] ? v[i] : addGate(GateOpcode::Mux, n[k], v[i], src);
+        }
+        v.swap(next);
+    }
+
+    LogicalVector rs(w);
+    GateId out = -1;
+    if (!over.empty()) {
+        LogicalVector bits;
+        for (GateId idx : over)
+            bits += LogicalVector(idx, 1);
+        out = addGateSum(GateOpcode::Or, bits);
+    }
+    for (int i = 0; i < w; ++i)
+        rs.set(i, out < 0 || v[i] == fill ? v[i] : addGate(GateOpcode::Mux, out, v[i], fill));
+    rs.pack();
+    return rs;
+}
+
+// a - b as a + NOT b + 1 reduced to its carry out, a balanced tree of the
+// same merge as addAdd(). The propagate of all the bits is a == b.
+LogicalVector UnitBuilder::addCompare(const LogicalVector &a, const LogicalVector &b)
+{
+    int n = a.length;
+    if (n == 0 || b.length != n)
+        throw "Invalid";
+    std::vector<GateId> g(n), p(n);
+    for (int i = 0; i < n; ++i) {
+        g[i] = addGate(GateOpcode::And, a[i], addGate(GateOpcode::Not, b[i]));
+        p[i] = addGate(GateOpcode::Not, addGate(GateOpcode::Xor, a[i], b[i]));
+    }
+    while (g.size() > 1) {
+        size_t m = 0;
+        for (size_t i = 0; i + 1 < g.size(); i += 2, ++m) {
+            g[m] = addGate(GateOpcode::Or, g[i + 1], addGate(GateOpcode::And, p[i + 1], g[i]));
+            p[m] = addGate(GateOpcode::And, p[i + 1], p[i]);
+        }
+        if (g.size() % 2 == 1) {
+            g[m] = g.back();
+            p[m] = p.back();
+            m++;
+        }
+        g.resize(m);
+        p.resize(m);
+    }
+    GateId ltu = addGate(GateOpcode::Nor, g[0], p[0]);
+    LogicalVector rs(3);
+    rs.set(0, p[0]);
+    rs.set(1, ltu);
+    rs.set(2, addGate(GateOpcode::Xor, ltu, addGate(GateOpcode::Xor, a[n - 1], b[n - 1])));
+    rs.pack();
+    return rs;
+}
+
+GateId UnitBuilder::addGateSum(GateOpcode opcode, const LogicalVector &vc)
 {
     if (vc.length == 1)
         return vc[0];
@@ -162,16 +670,798 @@ int UnitBuilder::addGateSum(GateOpcode opcode, LogicalVector vc)
         int k = (vc.length - 1) / 2;
         auto v1 = vc.sub(0, k);
         auto v2 = vc.sub(k+1, vc.length - 1);
-        int i1 = v1.length == 1 ? v1[0] : addGateSum(opcode, v1);
-        int i2 = v2.length == 1 ? v2[0] : addGateSum(opcode, v2);
+        GateId i1 = v1.length == 1 ? v1[0] : addGateSum(opcode, v1);
+        GateId i2 = v2.length == 1 ? v2[0] : addGateSum(opcode, v2);
         return addGate(opcode, i1, i2);
     }
 }
 
-void UnitBuilder::tick()
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+static std::string cellPin(size_t cell, const std::string &pin)
+{
+    return "$" + std::to_string(cell) + "." + pin;
+}
+
+LogicalVector UnitBuilder::addCell(GateOpcode opcode, int width, const LogicalVector &d, const LogicalVector &addr,
+    const LogicalVector &we, const LogicalVector &clk, std::vector<uint64_t> memory)
+{
+    if (width <= 0 || clk.length != 1)
+        throw "Invalid";
+    size_t cell = cells.size();
+    GateId start = pen;
+    for (int i = 0; i < width; ++i)
+        addGate(opcode);
+    LogicalVector q(start, width);
+    vectors[cellPin(cell, "q")] = q;
+    vectors[cellPin(cell, "clk")] = clk;
+    if (d.length > 0)
+        vectors[cellPin(cell, "d")] = d;
+    if (addr.length > 0)
+        vectors[cellPin(cell, "addr")] = addr;
+    if (we.length > 0)
+        vectors[cellPin(cell, "we")] = we;
+
+    MacroCell c;
+    c.opcode = opcode;
+    c.memory = std::move(memory);
+    c.rise = false;
+    c.lastClk = false;
+    c.lastLanes = 0;
+    c.lastTri = TriX;
+    cells.push_back(std::move(c));
+    cellsBound = false;
+    return q;
+}
+
+LogicalVector UnitBuilder::addReg(const LogicalVector &d, const LogicalVector &clk)
+{
+    return addCell(GateOpcode::Reg, d.length, d, LogicalVector(), LogicalVector(), clk, {});
+}
+
+LogicalVector UnitBuilder::addRam(int words, const LogicalVector &addr, const LogicalVector &d,
+    const LogicalVector &we, const LogicalVector &clk)
+{
+    if (d.length > 64 || we.length != 1 || addr.length > 30 || words <= 0 || words > (1 << addr.length))
+        throw "Invalid";
+    return addCell(GateOpcode::Ram, d.length, d, addr, we, clk, std::vector<uint64_t>(words, 0));
+}
+
+LogicalVector UnitBuilder::addRom(const std::string &path, int width, const LogicalVector &addr, const LogicalVector &clk)
+{
+    if (width > 64 || addr.length > 30)
+        throw "Invalid";
+    std::ifstream rd(path, std::ios::in);
+    if (!rd.is_open())
+        throw "Unable to open";
+    uint64_t mask = width >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << width) - 1;
+    std::vector<uint64_t> memory;
+    std::string ln;
+    while (std::getline(rd, ln)) {
+        ln = ln.substr(0, ln.find('#'));
+        size_t s = ln.find_first_not_of(" \t\r");
+        if (s == std::string::npos)
+            continue;
+        memory.push_back(std::strtoull(ln.c_str() + s, NULL, 16) & mask);
+    }
+    if (memory.size() > ((size_t)1 << addr.length))
+        throw "Out of range";
+    return addCell(GateOpcode::Rom, width, LogicalVector(), addr, LogicalVector(), clk, std::move(memory));
+}
+
+void UnitBuilder::bindCell(int cell, const std::string &pin, const LogicalVector &vc)
+{
+    if (cell < 0 || cell >= (int)cells.size())
+        throw "Out of range";
+    auto it = vectors.find(cellPin(cell, pin));
+    if (it == vectors.end() || it->second.length != vc.length)
+        throw "Invalid";
+    for (int i = 0; i < vc.length; ++i) {
+        if (vc[i] < 0)
+            throw "Undefined";
+    }
+    it->second = vc;
+    cellsBound = false;
+}
+
+// Pins are looked up again after the board was renumbered
+void UnitBuilder::bindCells()
+{
+    for (size_t k = 0; k < cells.size(); ++k) {
+        auto &c = cells[k];
+        LogicalVector *pins[] = { &c.d, &c.addr, &c.we, &c.clk, &c.q };
+        const char *names[] = { "d", "addr", "we", "clk", "q" };
+        for (int p = 0; p < 5; ++p) {
+            auto it = vectors.find(cellPin(k, names[p]));
+            *pins[p] = it == vectors.end() ? LogicalVector() : it->second;
+            for (int i = 0; i < pins[p]->length; ++i) {
+                if ((*pins[p])[i] < 0)
+                    throw "Unbound";
+            }
+        }
+        c.next.assign(c.q.length, 0);
+    }
+    cellsBound = true;
+}
+
+uint64_t UnitBuilder::readCell(int cell, int addr) const
+{
+    if (cell < 0 || cell >= (int)cells.size() || addr < 0 || addr >= (int)cells[cell].memory.size())
+        throw "Out of range";
+    return cells[cell].memory[addr];
+}
+
+void UnitBuilder::writeCell(int cell, int addr, uint64_t value)
+{
+    if (cell < 0 || cell >= (int)cells.size() || addr < 0 || addr >= (int)cells[cell].memory.size())
+        throw "Out of range";
+    cells[cell].memory[addr] = value;
+}
+
+std::map<std::string, LogicalVector> UnitBuilder::addInstance(const UnitBuilder &unit,
+    const std::map<std::string, LogicalVector> &ports)
+{
+    std::vector<GateId> map((size_t)unit.pen, -1);
+    for (auto &pr : ports) {
+        auto it = unit.vectors.find(pr.first);
+        if (it == unit.vectors.end())
+            throw "Undefined";
+        if (it->second.length != pr.second.length)
+            throw "Invalid";
+        for (int i = 0; i < pr.second.length; ++i) {
+            GateId from = it->second[i];
+            if (from < 0 || unit.board[from].opcode != GateOpcode::Fix)
+                throw "Invalid";
+            if (pr.second[i] < 0)
+                throw "Undefined";
+            map[from] = pr.second[i];
+        }
+    }
+
+    // Pins only read earlier gates, one pass relocates the whole board
+    board.reserve((size_t)pen + (size_t)unit.pen);
+    auto pinOf = [&](GateId pin) { return pin < 0 ? -1 : map[pin]; };
+    for (GateId i = 0; i < unit.pen; ++i) {
+        if (map[i] >= 0)
+            continue;
+        auto &g = unit.board[i];
+        map[i] = addGate(g.opcode, pinOf(g.pin1), pinOf(g.pin2), pinOf(g.pin3), pinOf(g.pin4), g.table);
+        if (map[i] == pen - 1) {
+            board[map[i]].value = g.value;
+            board[map[i]].lanes = g.lanes;
+        }
+    }
+
+    auto relocate = [&](const LogicalVector &vc) {
+        LogicalVector rs(vc.length);
+        for (int i = 0; i < vc.length; ++i) {
+            if (vc[i] >= 0)
+                rs.set(i, map[vc[i]]);
+        }
+        rs.pack();
+        return rs;
+    };
+    size_t base = cells.size();
+    for (size_t k = 0; k < unit.cells.size(); ++k) {
+        MacroCell c;
+        c.opcode = unit.cells[k].opcode;
+        c.memory = unit.cells[k].memory;
+        c.rise = false;
+        c.lastClk = false;
+        c.lastLanes = 0;
+        c.lastTri = TriX;
+        cells.push_back(std::move(c));
+        const char *names[] = { "d", "addr", "we", "clk", "q" };
+        for (auto name : names) {
+            auto it = unit.vectors.find(cellPin(k, name));
+            if (it != unit.vectors.end())
+                vectors[cellPin(base + k, name)] = relocate(it->second);
+        }
+    }
+    if (!unit.cells.empty())
+        cellsBound = false;
+
+    std::map<std::string, LogicalVector> named;
+    for (auto &pr : unit.vectors) {
+        if (pr.first[0] != '$' && ports.find(pr.first) == ports.end())
+            named.insert(std::make_pair(pr.first, relocate(pr.second)));
+    }
+    return named;
+}
+
+uint64_t UnitBuilder::cellWord(const LogicalVector &vc) const
+{
+    uint64_t word = 0;
+    for (int i = 0; i < vc.length; ++i)
+        word |= (uint64_t)board[vc[i]].value << i;
+    return word;
+}
+
+// Every cell samples its pins before any q changes, a cell may read the
+// output of another one
+void UnitBuilder::tickCells()
+{
+    if (!cellsBound)
+        bindCells();
+    for (auto &c : cells) {
+        bool clk = board[c.clk[0]].value;
+        c.rise = clk && !c.lastClk;
+        c.lastClk = clk;
+        if (!c.rise)
+            continue;
+        if (c.opcode == GateOpcode::Reg) {
+            for (int i = 0; i < c.q.length; ++i)
+                c.next[i] = board[c.d[i]].value;
+            continue;
+        }
+        uint64_t addr = cellWord(c.addr);
+        uint64_t word = addr < c.memory.size() ? c.memory[addr] : 0;
+        if (c.opcode == GateOpcode::Ram && board[c.we[0]].value && addr < c.memory.size())
+            c.memory[addr] = cellWord(c.d);
+        for (int i = 0; i < c.q.length; ++i)
+            c.next[i] = (word >> i) & 1;
+    }
+    for (auto &c : cells) {
+        if (!c.rise)
+            continue;
+        for (int i = 0; i < c.q.length; ++i) {
+            board[c.q[i]].value = c.next[i] != 0;
+            if (incremental)
+                touched.push_back(c.q[i]);
+        }
+    }
+}
+
+// Lanes share the memory of a cell, so only Reg and Rom can run per lane
+void UnitBuilder::tickCellLanes()
+{
+    if (!cellsBound)
+        bindCells();
+    std::vector<uint64_t> rises(cells.size());
+    for (size_t k = 0; k < cells.size(); ++k) {
+        auto &c = cells[k];
+        if (c.opcode == GateOpcode::Ram)
+            throw "Unsupported";
+        uint64_t clk = board[c.clk[0]].lanes;
+        uint64_t rise = clk & ~c.lastLanes;
+        c.lastLanes = clk;
+        rises[k] = rise;
+        if (c.opcode == GateOpcode::Reg) {
+            for (int i = 0; i < c.q.length; ++i)
+                c.next[i] = board[c.d[i]].lanes;
+            continue;
+        }
+        for (int i = 0; i < c.q.length; ++i)
+            c.next[i] = 0;
+        for (int l = 0; l < LANES; ++l) {
+            if (((rise >> l) & 1) == 0)
+                continue;
+            uint64_t addr = 0;
+            for (int i = 0; i < c.addr.length; ++i)
+                addr |= ((board[c.addr[i]].lanes >> l) & 1) << i;
+            uint64_t word = addr < c.memory.size() ? c.memory[addr] : 0;
+            for (int i = 0; i < c.q.length; ++i)
+                c.next[i] |= ((word >> i) & 1) << l;
+        }
+    }
+    for (size_t k = 0; k < cells.size(); ++k) {
+        auto &c = cells[k];
+        for (int i = 0; i < c.q.length; ++i) {
+            auto &g = board[c.q[i]];
+            g.lanes = (g.lanes & ~rises[k]) | (c.next[i] & rises[k]);
+        }
+    }
+}
+
+// Lanes where clk may rise take q or the new word, the ones where it rose
+// for sure take the word. An address with X lanes reads an X word.
+void UnitBuilder::tickCellTri()
 {
-    for (int i = 0; i < pen; ++i) {
-        auto g = &board[i];
+    if (!cellsBound)
+        bindCells();
+    std::vector<uint64_t> maybe(cells.size());
+    std::vector<uint64_t> sure(cells.size());
+    std::vector<std::vector<TriLanes>> next(cells.size());
+    for (size_t k = 0; k < cells.size(); ++k) {
+        auto &c = cells[k];
+        if (c.opcode == GateOpcode::Ram)
+            throw "Unsupported";
+        TriLanes clk = tri[c.clk[0]];
+        maybe[k] = clk.one & c.lastTri.zero;
+        sure[k] = maybe[k] & ~clk.zero & ~c.lastTri.one;
+        c.lastTri = clk;
+        if (c.opcode == GateOpcode::Reg) {
+            for (int i = 0; i < c.q.length; ++i)
+                next[k].push_back(tri[c.d[i]]);
+            continue;
+        }
+        next[k].assign(c.q.length, TriLanes{ 0, 0 });
+        for (int l = 0; l < LANES; ++l) {
+            if (((maybe[k] >> l) & 1) == 0)
+                continue;
+            uint64_t addr = 0;
+            bool unknown = false;
+            for (int i = 0; i < c.addr.length; ++i) {
+                TriLanes a = tri[c.addr[i]];
+                unknown |= ((a.one & a.zero) >> l) & 1;
+                addr |= ((a.one >> l) & 1) << i;
+            }
+            uint64_t word = addr < c.memory.size() ? c.memory[addr] : 0;
+            uint64_t bit = (uint64_t)1 << l;
+            for (int i = 0; i < c.q.length; ++i) {
+                bool one = (word >> i) & 1;
+                if (unknown || one)
+                    next[k][i].one |= bit;
+                if (unknown || !one)
+                    next[k][i].zero |= bit;
+            }
+        }
+    }
+    for (size_t k = 0; k < cells.size(); ++k) {
+        auto &c = cells[k];
+        for (int i = 0; i < c.q.length; ++i) {
+            auto &t = tri[c.q[i]];
+            t.one = (next[k][i].one & maybe[k]) | (t.one & ~sure[k]);
+            t.zero = (next[k][i].zero & maybe[k]) | (t.zero & ~sure[k]);
+        }
+    }
+}
+
+// Result of a gate while optimizing: a constant or a gate of the new board
+struct FoldedPin
+{
+    GateId index; // -1 for a constant
+    bool value;
+};
+
+// Truth table of a Mux, Maj3 or Lut4 gate in the Lut4 order
+static uint16_t gateTable(const LogicalGate &g)
+{
+    switch (g.opcode) {
+    case GateOpcode::Mux:
+        return 0xE4;
+    case GateOpcode::Maj3:
+        return 0xE8;
+    default:
+        return g.table;
+    }
+}
+
+// Table with input k wired to input j (j < k), k is removed
+static uint16_t mergeInputs(uint16_t table, int j, int k)
+{
+    uint16_t rs = 0;
+    for (int idx = 0; idx < 16; ++idx) {
+        if (((idx >> j) & 1) != ((idx >> k) & 1))
+            continue;
+        int dst = (idx & ((1 << k) - 1)) | ((idx >> (k + 1)) << k);
+        rs |= ((table >> idx) & 1) << dst;
+    }
+    return rs;
+}
+
+void UnitBuilder::optimize()
+{
+    GateId before = pen;
+    int depthBefore = maxDepth;
+    std::vector<LogicalGate> gates;
+    std::vector<FoldedPin> repl(pen);
+    GateId constGate[2] = { -1, -1 };
+
+    auto emit = [&](GateOpcode opcode, GateId pin1, GateId pin2, const LogicalGate &from) {
+        LogicalGate g = from;
+        g.opcode = opcode;
+        g.pin1 = pin1;
+        g.pin2 = pin2;
+        g.pin3 = -1;
+        g.pin4 = -1;
+        g.table = 0;
+        gates.push_back(g);
+        return FoldedPin{ (GateId)gates.size() - 1, false };
+    };
+    auto emitWide = [&](GateOpcode opcode, const FoldedPin *pins, int n, uint16_t table, const LogicalGate &from) {
+        LogicalGate g = from;
+        g.opcode = opcode;
+        g.pin1 = pins[0].index;
+        g.pin2 = n > 1 ? pins[1].index : -1;
+        g.pin3 = n > 2 ? pins[2].index : -1;
+        g.pin4 = n > 3 ? pins[3].index : -1;
+        g.table = opcode == GateOpcode::Lut4 ? table : 0;
+        gates.push_back(g);
+        return FoldedPin{ (GateId)gates.size() - 1, false };
+    };
+    auto constant = [](bool value) { return FoldedPin{ -1, value }; };
+    auto invert = [&](FoldedPin pin, const LogicalGate &from) {
+        if (pin.index < 0)
+            return constant(!pin.value);
+        return emit(GateOpcode::Not, pin.index, -1, from);
+    };
+    auto resolve = [&](FoldedPin pin, const LogicalGate &from) {
+        if (pin.index >= 0)
+            return pin.index;
+        GateId &idx = constGate[pin.value];
+        if (idx < 0)
+            idx = emit(pin.value ? GateOpcode::One : GateOpcode::Zero, -1, -1, from).index;
+        return idx;
+    };
+
+    // Forward pass, gates only read earlier gates
+    for (GateId i = 0; i < pen; ++i) {
+        auto &g = board[i];
+        FoldedPin a = g.pin1 >= 0 ? repl[g.pin1] : constant(false);
+        FoldedPin b = g.pin2 >= 0 ? repl[g.pin2] : constant(false);
+        bool same = a.index >= 0 && a.index == b.index;
+        if (g.pin2 >= 0 && a.index < 0 && b.index >= 0)
+            std::swap(a, b); // Keep the constant operand second
+        switch (g.opcode) {
+        case GateOpcode::Zero:
+            repl[i] = constant(false);
+            break;
+        case GateOpcode::One:
+            repl[i] = constant(true);
+            break;
+        case GateOpcode::And:
+        case GateOpcode::Nand: {
+            bool neg = g.opcode == GateOpcode::Nand;
+            if (b.index < 0 && a.index < 0)
+                repl[i] = constant((a.value && b.value) != neg);
+            else if (b.index < 0)
+                repl[i] = !b.value ? constant(neg) : (neg ? invert(a, g) : a);
+            else if (same)
+                repl[i] = neg ? invert(a, g) : a;
+            else
+                repl[i] = emit(g.opcode, a.index, b.index, g);
+            break;
+        }
+        case GateOpcode::Or:
+        case GateOpcode::Nor: {
+            bool neg = g.opcode == GateOpcode::Nor;
+            if (b.index < 0 && a.index < 0)
+                repl[i] = constant((a.value || b.value) != neg);
+            else if (b.index < 0)
+                repl[i] = b.value ? constant(!neg) : (neg ? invert(a, g) : a);
+            else if (same)
+                repl[i] = neg ? invert(a, g) : a;
+            else
+                repl[i] = emit(g.opcode, a.index, b.index, g);
+            break;
+        }
+        case GateOpcode::Xor:
+            if (b.index < 0 && a.index < 0)
+                repl[i] = constant(a.value != b.value);
+            else if (b.index < 0)
+                repl[i] = b.value ? invert(a, g) : a;
+            else if (same)
+                repl[i] = constant(false);
+            else
+                repl[i] = emit(g.opcode, a.index, b.index, g);
+            break;
+        case GateOpcode::Not:
+            repl[i] = invert(a, g);
+            break;
+        case GateOpcode::Mux:
+        case GateOpcode::Maj3:
+        case GateOpcode::Lut4: {
+            // Constant, repeated and unused inputs are removed from the table
+            GateId from[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+            FoldedPin pins[4];
+            for (int k = 0; k < 4; ++k)
+                pins[k] = from[k] >= 0 ? repl[from[k]] : constant(false);
+            uint16_t table = gateTable(g);
+            int n = g.opcode == GateOpcode::Lut4 ? 4 : 3;
+            int width = n;
+            for (int k = n; k-- > 0; ) {
+                if (pins[k].index < 0) {
+                    table = lutCofactor(table, k, pins[k].value);
+                    std::copy(pins + k + 1, pins + n--, pins + k);
+                }
+            }
+            for (int k = n; k-- > 1; ) {
+                for (int j = 0; j < k; ++j) {
+                    if (pins[j].index == pins[k].index) {
+                        table = mergeInputs(table, j, k);
+                        std::copy(pins + k + 1, pins + n--, pins + k);
+                        break;
+                    }
+                }
+            }
+            for (int k = n; k-- > 0; ) {
+                if (lutCofactor(table, k, false) == lutCofactor(table, k, true)) {
+                    table = lutCofactor(table, k, false);
+                    std::copy(pins + k + 1, pins + n--, pins + k);
+                }
+            }
+            if (n == 0)
+                repl[i] = constant(table & 1);
+            else if (n == 1)
+                repl[i] = (table & 3) == 2 ? pins[0] : invert(pins[0], g);
+            else if (n == width && table == gateTable(g))
+                repl[i] = emitWide(g.opcode, pins, n, g.table, g);
+            else
+                repl[i] = emitWide(GateOpcode::Lut4, pins, n, table, g);
+            break;
+        }
+        default:
+            // Inputs and stateful gates are kept as they are
+            repl[i] = emit(g.opcode, g.pin1 >= 0 ? resolve(repl[g.pin1], g) : -1,
+                g.pin2 >= 0 ? resolve(repl[g.pin2], g) : -1, g);
+            break;
+        }
+    }
+
+    // Backward pass, keep the cone of the named vectors
+    std::vector<GateId> roots;
+    for (auto &pr : vectors) {
+        for (int i = 0; i < pr.second.length; ++i) {
+            if (pr.second[i] >= 0)
+                roots.push_back(resolve(repl[pr.second[i]], board[pr.second[i]]));
+        }
+    }
+    std::vector<char> live(gates.size(), 0);
+    for (GateId idx : roots)
+        live[idx] = 1;
+    for (size_t i = gates.size(); i-- > 0; ) {
+        if (!live[i])
+            continue;
+        if (gates[i].pin1 >= 0)
+            live[gates[i].pin1] = 1;
+        if (gates[i].pin2 >= 0)
+            live[gates[i].pin2] = 1;
+        if (gates[i].pin3 >= 0)
+            live[gates[i].pin3] = 1;
+        if (gates[i].pin4 >= 0)
+            live[gates[i].pin4] = 1;
+    }
+
+    // Compact and rebuild the board
+    std::vector<GateId> index(gates.size(), -1);
+    GateId count = 0;
+    for (size_t i = 0; i < gates.size(); ++i) {
+        if (live[i])
+            index[i] = count++;
+    }
+    std::map<std::string, LogicalVector> remapped;
+    for (auto &pr : vectors) {
+        auto &vc = pr.second;
+        LogicalVector rs(vc.length);
+        for (int i = 0; i < vc.length; ++i) {
+            if (vc[i] >= 0)
+                rs.set(i, index[resolve(repl[vc[i]], board[vc[i]])]);
+        }
+        rs.pack();
+        remapped.insert(std::make_pair(pr.first, rs));
+    }
+
+    std::vector<LogicalGate> kept;
+    for (size_t i = 0; i < gates.size(); ++i) {
+        if (!live[i])
+            continue;
+        LogicalGate g = gates[i];
+        g.pin1 = g.pin1 >= 0 ? index[g.pin1] : -1;
+        g.pin2 = g.pin2 >= 0 ? index[g.pin2] : -1;
+        g.pin3 = g.pin3 >= 0 ? index[g.pin3] : -1;
+        g.pin4 = g.pin4 >= 0 ? index[g.pin4] : -1;
+        kept.push_back(g);
+    }
+    rebuild(kept, remapped);
+
+    std::cout << "OPTIMIZE (" << before << " -> " << pen << " gates, depth "
+        << depthBefore << " -> " << maxDepth << ")" << std::endl;
+}
+
+void UnitBuilder::rebuild(const std::vector<LogicalGate> &gates, const std::map<std::string, LogicalVector> &named)
+{
+    pen = 0;
+    maxDepth = 0;
+    maxUsage = 0;
+    bool rehash = hashing;
+    setHashing(false);
+    for (auto &g : gates) {
+        addGate(g.opcode, g.pin1, g.pin2, g.pin3, g.pin4, g.table);
+        board[pen - 1].value = g.value;
+        board[pen - 1].lanes = g.lanes;
+    }
+    vectors = named;
+    decoders.clear();
+    cellsBound = false;
+    probes.clear();
+    tri.clear();
+    setHashing(rehash);
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+void UnitBuilder::setProbes(const std::vector<LogicalVector> &outputs)
+{
+    probes.clear();
+    for (auto &vc : outputs) {
+        for (int i = 0; i < vc.length; ++i) {
+            if (vc[i] < 0 || vc[i] >= pen)
+                throw "Invalid";
+            probes.push_back(vc[i]);
+        }
+    }
+    coneValid = false;
+    settled = false;
+}
+
+// Backward sweep in board order, the stateful gates and the pins of the
+// macro cells are always kept so the state is the same as a full tick
+void UnitBuilder::buildCone()
+{
+    if (!cells.empty() && !cellsBound)
+        bindCells();
+    inCone.assign((size_t)pen, 0);
+    for (GateId idx : probes)
+        inCone[idx] = 1;
+    for (auto &c : cells) {
+        const LogicalVector *pins[] = { &c.d, &c.addr, &c.we, &c.clk };
+        for (auto vc : pins) {
+            for (int i = 0; i < vc->length; ++i)
+                inCone[(*vc)[i]] = 1;
+        }
+    }
+    // Cells commit q after the gates, a reader of q added later would see
+    // the value after the edge, so everything fed by a q stays in the cone
+    if (!cells.empty()) {
+        std::vector<char> late((size_t)pen, 0);
+        for (auto &c : cells) {
+            for (int i = 0; i < c.q.length; ++i)
+                late[c.q[i]] = 1;
+        }
+        for (GateId i = 0; i < pen; ++i) {
+            auto &g = board[i];
+            GateId pins[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+            for (GateId pin : pins) {
+                if (pin >= 0 && late[pin]) {
+                    late[i] = 1;
+                    inCone[i] = 1;
+                    break;
+                }
+            }
+        }
+    }
+    for (GateId i = pen; i-- > 0; ) {
+        auto &g = board[i];
+        if (g.opcode == GateOpcode::Clk || g.opcode == GateOpcode::RS)
+            inCone[i] = 1;
+        if (!inCone[i])
+            continue;
+        GateId pins[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+        for (GateId pin : pins) {
+            if (pin >= 0)
+                inCone[pin] = 1;
+        }
+    }
+    cone.clear();
+    for (GateId i = 0; i < pen; ++i) {
+        if (inCone[i])
+            cone.push_back(i);
+    }
+    coneValid = true;
+}
+
+// A gate read outside of the cone joins the probes. The gates it brings
+// are evaluated at once from the values on the board, the stateful ones
+// are in the cone already.
+void UnitBuilder::extendCone(GateId idx, bool lanes)
+{
+    if (!coneValid || !cellsBound)
+        buildCone();
+    if (inCone[idx])
+        return;
+    probes.push_back(idx);
+    size_t from = cone.size();
+    inCone[idx] = 2;
+    for (GateId i = idx; i >= 0; --i) {
+        if (inCone[i] != 2)
+            continue;
+        auto &g = board[i];
+        GateId pins[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+        for (GateId pin : pins) {
+            if (pin >= 0 && !inCone[pin])
+                inCone[pin] = 2;
+        }
+        inCone[i] = 1;
+        cone.push_back(i);
+    }
+    std::reverse(cone.begin() + from, cone.end());
+    if (lanes && xmode) {
+        tri.resize((size_t)pen, TriX);
+        evalTri<true>(cone.data() + from, cone.size() - from);
+    } else if (lanes) {
+        evalLanes<true>(cone.data() + from, cone.size() - from);
+    } else {
+        evalValues<true>(cone.data() + from, cone.size() - from);
+    }
+    std::inplace_merge(cone.begin(), cone.begin() + from, cone.end());
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+void UnitBuilder::setIncremental(bool enable)
+{
+    incremental = enable;
+    settled = false;
+    skipped = 0;
+    touched.clear();
+}
+
+// Readers of each gate, the stateful gates are evaluated on every tick
+void UnitBuilder::buildFanouts()
+{
+    fanoutStart.assign((size_t)pen + 1, 0);
+    stateful.clear();
+    for (GateId i = 0; i < pen; ++i) {
+        auto &g = board[i];
+        GateId pins[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+        for (GateId pin : pins) {
+            if (pin >= 0)
+                fanoutStart[pin + 1]++;
+        }
+        if (g.opcode == GateOpcode::Clk || g.opcode == GateOpcode::RS)
+            stateful.push_back(i);
+    }
+    for (GateId i = 0; i < pen; ++i)
+        fanoutStart[i + 1] += fanoutStart[i];
+    fanouts.resize(fanoutStart[pen]);
+    std::vector<GateId> pos(fanoutStart.begin(), fanoutStart.end() - 1);
+    for (GateId i = 0; i < pen; ++i) {
+        auto &g = board[i];
+        GateId pins[4] = { g.pin1, g.pin2, g.pin3, g.pin4 };
+        for (GateId pin : pins) {
+            if (pin >= 0)
+                fanouts[pos[pin]++] = i;
+        }
+    }
+    dirty.assign((size_t)pen, 0);
+}
+
+// Sweep in board order from the lowest dirty gate. Touched gates (2)
+// always wake their readers, evaluated ones (1) only when they changed.
+void UnitBuilder::tickIncremental()
+{
+    if (!probes.empty() && (!coneValid || !cellsBound))
+        buildCone();
+    GateId lo = pen;
+    GateId hi = -1;
+    auto mark = [&](GateId idx, char flag) {
+        if (dirty[idx] < flag)
+            dirty[idx] = flag;
+        lo = std::min(lo, idx);
+        hi = std::max(hi, idx);
+    };
+    for (GateId idx : stateful)
+        mark(idx, 1);
+    for (GateId idx : touched)
+        mark(idx, 2);
+    touched.clear();
+
+    GateId evaluated = 0;
+    for (GateId i = lo; i <= hi; ++i) {
+        char flag = dirty[i];
+        if (flag == 0)
+            continue;
+        dirty[i] = 0;
+        if (!probes.empty() && !inCone[i])
+            continue;
+        bool before = board[i].value;
+        evalValues<true>(&i, 1);
+        evaluated++;
+        if (flag == 1 && board[i].value == before)
+            continue;
+        for (GateId k = fanoutStart[i]; k < fanoutStart[i + 1]; ++k)
+            mark(fanouts[k], 1);
+    }
+    skipped += (uint64_t)(pen - evaluated);
+}
+
+// Gates listed in order or the first count gates of the board
+template <bool Ordered>
+void UnitBuilder::evalValues(const GateId *order, size_t count)
+{
+    for (size_t k = 0; k < count; ++k) {
+        auto g = &board[Ordered ? order[k] : (GateId)k];
         switch (g->opcode) {
         case GateOpcode::Zero:
             g->value = false;
@@ -210,34 +1500,329 @@ void UnitBuilder::tick()
         case GateOpcode::Not:
             g->value = !board[g->pin1].value;
             break;
+        case GateOpcode::Mux:
+            g->value = board[g->pin1].value ? board[g->pin3].value : board[g->pin2].value;
+            break;
+        case GateOpcode::Maj3: {
+            int n = board[g->pin1].value + board[g->pin2].value + board[g->pin3].value;
+            g->value = n >= 2;
+            break;
+        }
+        case GateOpcode::Lut4:
+            g->value = lutValue(g->table, board[g->pin1].value, g->pin2 >= 0 && board[g->pin2].value,
+                g->pin3 >= 0 && board[g->pin3].value, g->pin4 >= 0 && board[g->pin4].value);
+            break;
         case GateOpcode::In:
             break;
         case GateOpcode::Out:
             break;
+        default:
+            break; // Macro cells are done after the gates
         }
     }
 }
 
-void UnitBuilder::set(int idx, bool value)
+void UnitBuilder::tick()
+{
+    if (incremental && settled) {
+        tickIncremental();
+    } else {
+        if (probes.empty()) {
+            evalValues<false>(nullptr, (size_t)pen);
+        } else {
+            if (!coneValid || !cellsBound)
+                buildCone();
+            evalValues<true>(cone.data(), cone.size());
+        }
+        if (incremental)
+            buildFanouts();
+        touched.clear();
+        settled = incremental;
+    }
+    if (!cells.empty())
+        tickCells();
+}
+
+void UnitBuilder::set(GateId idx, bool value)
 {
     if (idx < 0 || idx >= pen)
         return;
+    if (incremental && board[idx].value != value)
+        touched.push_back(idx);
     board[idx].value = value;
 }
 
-bool UnitBuilder::get(int idx)
+bool UnitBuilder::get(GateId idx)
 {
     if (idx < 0 || idx >= pen)
         return false;
+    if (!probes.empty())
+        extendCone(idx, false);
     return board[idx].value;
 }
 
+static uint64_t randomLanes()
+{
+    uint64_t word = 0;
+    for (int i = 0; i < 4; ++i)
+        word = (word << 16) | (rand() & 0xffff);
+    return word;
+}
+
+// Gates listed in order or the first count gates of the board
+template <bool Ordered>
+void UnitBuilder::evalLanes(const GateId *order, size_t count)
+{
+    for (size_t k = 0; k < count; ++k) {
+        auto g = &board[Ordered ? order[k] : (GateId)k];
+        switch (g->opcode) {
+        case GateOpcode::Zero:
+            g->lanes = 0;
+            break;
+        case GateOpcode::One:
+            g->lanes = ~(uint64_t)0;
+            break;
+        case GateOpcode::Clk:
+            g->lanes = ~g->lanes;
+            break;
+        case GateOpcode::Fix:
+            break;
+        case GateOpcode::RS: {
+            uint64_t r = board[g->pin1].lanes;
+            uint64_t s = board[g->pin2].lanes;
+            g->lanes = (g->lanes & ~(r & ~s)) | (~r & s);
+            g->lanes = (g->lanes & ~(r & s)) | (randomLanes() & r & s); // Instable
+            break;
+        }
+        case GateOpcode::And:
+            g->lanes = board[g->pin1].lanes & board[g->pin2].lanes;
+            break;
+        case GateOpcode::Or:
+            g->lanes = board[g->pin1].lanes | board[g->pin2].lanes;
+            break;
+        case GateOpcode::Xor:
+            g->lanes = board[g->pin1].lanes ^ board[g->pin2].lanes;
+            break;
+        case GateOpcode::Nand:
+            g->lanes = ~(board[g->pin1].lanes & board[g->pin2].lanes);
+            break;
+        case GateOpcode::Nor:
+            g->lanes = ~(board[g->pin1].lanes | board[g->pin2].lanes);
+            break;
+        case GateOpcode::Not:
+            g->lanes = ~board[g->pin1].lanes;
+            break;
+        case GateOpcode::Mux: {
+            uint64_t sel = board[g->pin1].lanes;
+            g->lanes = (board[g->pin2].lanes & ~sel) | (board[g->pin3].lanes & sel);
+            break;
+        }
+        case GateOpcode::Maj3: {
+            uint64_t a = board[g->pin1].lanes;
+            uint64_t b = board[g->pin2].lanes;
+            uint64_t c = board[g->pin3].lanes;
+            g->lanes = (a & b) | (a & c) | (b & c);
+            break;
+        }
+        case GateOpcode::Lut4:
+            g->lanes = lutLanes(g->table, board[g->pin1].lanes, g->pin2 >= 0 ? board[g->pin2].lanes : 0,
+                g->pin3 >= 0 ? board[g->pin3].lanes : 0, g->pin4 >= 0 ? board[g->pin4].lanes : 0);
+            break;
+        case GateOpcode::In:
+            break;
+        case GateOpcode::Out:
+            break;
+        default:
+            break; // Macro cells are done after the gates
+        }
+    }
+}
+
+// Same gates on two planes, the stable state of an RS gate is kept where
+// both inputs may be 0
+template <bool Ordered>
+void UnitBuilder::evalTri(const GateId *order, size_t count)
+{
+    for (size_t k = 0; k < count; ++k) {
+        GateId i = Ordered ? order[k] : (GateId)k;
+        auto &g = board[i];
+        auto &t = tri[i];
+        switch (g.opcode) {
+        case GateOpcode::Zero:
+            t = triConst(false);
+            break;
+        case GateOpcode::One:
+            t = triConst(true);
+            break;
+        case GateOpcode::Clk:
+            std::swap(t.one, t.zero);
+            break;
+        case GateOpcode::Fix:
+            break;
+        case GateOpcode::RS: {
+            TriLanes r = tri[g.pin1];
+            TriLanes s = tri[g.pin2];
+            uint64_t hold = r.zero & s.zero;
+            t = TriLanes{ s.one | (hold & t.one), r.one | (hold & t.zero) };
+            break;
+        }
+        case GateOpcode::And:
+            t = TriLanes{ tri[g.pin1].one & tri[g.pin2].one, tri[g.pin1].zero | tri[g.pin2].zero };
+            break;
+        case GateOpcode::Or:
+            t = TriLanes{ tri[g.pin1].one | tri[g.pin2].one, tri[g.pin1].zero & tri[g.pin2].zero };
+            break;
+        case GateOpcode::Xor: {
+            TriLanes a = tri[g.pin1];
+            TriLanes b = tri[g.pin2];
+            t = TriLanes{ (a.one & b.zero) | (a.zero & b.one), (a.one & b.one) | (a.zero & b.zero) };
+            break;
+        }
+        case GateOpcode::Nand:
+            t = TriLanes{ tri[g.pin1].zero | tri[g.pin2].zero, tri[g.pin1].one & tri[g.pin2].one };
+            break;
+        case GateOpcode::Nor:
+            t = TriLanes{ tri[g.pin1].zero & tri[g.pin2].zero, tri[g.pin1].one | tri[g.pin2].one };
+            break;
+        case GateOpcode::Not:
+            t = TriLanes{ tri[g.pin1].zero, tri[g.pin1].one };
+            break;
+        case GateOpcode::Mux:
+            t = triMux(tri[g.pin1], tri[g.pin2], tri[g.pin3]);
+            break;
+        case GateOpcode::Maj3: {
+            TriLanes a = tri[g.pin1];
+            TriLanes b = tri[g.pin2];
+            TriLanes c = tri[g.pin3];
+            t = TriLanes{ (a.one & b.one) | (a.one & c.one) | (b.one & c.one),
+                (a.zero & b.zero) | (a.zero & c.zero) | (b.zero & c.zero) };
+            break;
+        }
+        case GateOpcode::Lut4:
+            t = lutTri(g.table, tri[g.pin1], g.pin2 >= 0 ? tri[g.pin2] : triConst(false),
+                g.pin3 >= 0 ? tri[g.pin3] : triConst(false), g.pin4 >= 0 ? tri[g.pin4] : triConst(false));
+            break;
+        default:
+            break; // Macro cells are done after the gates
+        }
+    }
+}
+
+void UnitBuilder::tickLanes()
+{
+    if (xmode) {
+        tri.resize((size_t)pen, TriX);
+        if (probes.empty()) {
+            evalTri<false>(nullptr, (size_t)pen);
+        } else {
+            if (!coneValid || !cellsBound)
+                buildCone();
+            evalTri<true>(cone.data(), cone.size());
+        }
+        if (!cells.empty())
+            tickCellTri();
+        return;
+    }
+    if (probes.empty()) {
+        evalLanes<false>(nullptr, (size_t)pen);
+    } else {
+        if (!coneValid || !cellsBound)
+            buildCone();
+        evalLanes<true>(cone.data(), cone.size());
+    }
+    if (!cells.empty())
+        tickCellLanes();
+}
+
+void UnitBuilder::setLanes(GateId idx, uint64_t lanes)
+{
+    if (idx < 0 || idx >= pen)
+        return;
+    board[idx].lanes = lanes;
+    if (xmode) {
+        tri.resize((size_t)pen, TriX);
+        tri[idx] = TriLanes{ lanes, ~lanes };
+    }
+}
+
+uint64_t UnitBuilder::getLanes(GateId idx)
+{
+    if (idx < 0 || idx >= pen)
+        return 0;
+    if (!probes.empty())
+        extendCone(idx, true);
+    if (xmode)
+        return idx < (GateId)tri.size() ? tri[idx].one & ~tri[idx].zero : 0;
+    return board[idx].lanes;
+}
+
+void UnitBuilder::setXMode(bool enable)
+{
+    xmode = enable;
+    tri.assign(enable ? (size_t)pen : 0, TriX);
+    for (auto &c : cells)
+        c.lastTri = TriX;
+}
+
+void UnitBuilder::setUnknown(GateId idx, uint64_t lanes)
+{
+    if (!xmode || idx < 0 || idx >= pen)
+        return;
+    tri.resize((size_t)pen, TriX);
+    tri[idx].one |= lanes;
+    tri[idx].zero |= lanes;
+}
+
+uint64_t UnitBuilder::getUnknown(GateId idx)
+{
+    if (!xmode || idx < 0 || idx >= pen)
+        return 0;
+    if (!probes.empty())
+        extendCone(idx, true);
+    return idx < (GateId)tri.size() ? tri[idx].one & tri[idx].zero : 0;
+}
+
+void UnitBuilder::setLanes(LogicalVector vc, const uint64_t *values, int count)
+{
+    if (count < 0 || count > LANES || vc.length > 64)
+        throw "Out of range";
+    for (int i = 0; i < vc.length; ++i) {
+        uint64_t word = 0;
+        for (int l = 0; l < count; ++l)
+            word |= ((values[l] >> i) & 1) << l;
+        setLanes(vc[i], word);
+    }
+}
+
+void UnitBuilder::getLanes(LogicalVector vc, uint64_t *values, int count)
+{
+    if (count < 0 || count > LANES || vc.length > 64)
+        throw "Out of range";
+    for (int l = 0; l < count; ++l)
+        values[l] = 0;
+    for (int i = 0; i < vc.length; ++i) {
+        uint64_t word = getLanes(vc[i]);
+        for (int l = 0; l < count; ++l)
+            values[l] |= ((word >> l) & 1) << i;
+    }
+}
+
+// Gates outside of the cone of the probes are not evaluated, they print
+// '-'. Inputs hold what set() wrote either way.
+char UnitBuilder::dumpValue(GateId idx) const
+{
+    bool input = board[idx].opcode == GateOpcode::Fix;
+    if (!probes.empty() && !input && (idx >= (GateId)inCone.size() || !inCone[idx]))
+        return '-';
+    return board[idx].value ? '1' : '0';
+}
+
 void UnitBuilder::dump()
 {
     for (auto pr : vectors) {
         std::cout << pr.first << ": ";
         for (int i = pr.second.length; i-- > 0; )
-            std::cout << (board[pr.second[i]].value ? '1' : '0');
+            std::cout << dumpValue(pr.second[i]);
         std::cout << std::endl;
     }
 }
@@ -245,13 +1830,12 @@ void UnitBuilder::dump()
 void UnitBuilder::dump2()
 {
     const int wz = 32;
-    for (int i = 0; i < pen; ++i) {
+    for (GateId i = 0; i < pen; ++i) {
         if (((i) % wz) == 0) {
             std::cout.width(5);
             std::cout << i << "   ";
         }
-        auto g = &board[i];
-        std::cout << (g->value ? '1' : '0') << ' ';
+        std::cout << dumpValue(i) << ' ';
         if (((i + 1) % wz) == 0)
             std::cout << std::endl;
     }
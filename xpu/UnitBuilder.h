@@ -1,8 +1,18 @@
 #pragma once
+#include <cstdint>
 #include <string>
 #include <map>
+#include <vector>
+#include <algorithm>
 
-enum class GateOpcode
+// Gate indices, define XPU_GATE64 for netlists above 2^31 gates
+#if defined(XPU_GATE64)
+typedef int64_t GateId;
+#else
+typedef int32_t GateId;
+#endif
+
+enum class GateOpcode : uint8_t
 {
     Zero,
     One,
@@ -17,76 +27,334 @@ enum class GateOpcode
     Not,
     In,
     Out,
+    Reg,
+    Ram,
+    Rom,
+    Mux,  // pin1 ? pin3 : pin2
+    Maj3,
+    Lut4, // table bit pin1 | pin2 << 1 | pin3 << 2 | pin4 << 3
+};
+
+// Carry network of addAdd()
+enum class PrefixNetwork
+{
+    KoggeStone, // log2(n) levels, about n log2(n) nodes
+    BrentKung,  // 2 log2(n) levels, about 2n nodes
+};
+
+enum class ShiftMode
+{
+    Shl,
+    Shr,
+    Sar,
+    Rol,
+    Ror,
 };
 
 struct LogicalGate
 {
 public:
-    int pin1;
-    int pin2;
+    GateId pin1;
+    GateId pin2;
+    GateId pin3;
+    GateId pin4;
+    uint16_t table;
     GateOpcode opcode;
     bool value;
+    uint64_t lanes;
     int depth;
     int usage;
 };
 
-struct LogicalVector
+// Lut4 on single values and on 64 lanes, missing pins read as 0
+inline bool lutValue(uint16_t table, bool a, bool b, bool c, bool d)
+{
+    return (table >> (a | b << 1 | c << 2 | d << 3)) & 1;
+}
+
+// Table with input k fixed to value, the inputs above it move down
+inline uint16_t lutCofactor(uint16_t table, int k, bool value)
+{
+    uint16_t rs = 0;
+    for (int idx = 0; idx < 16; ++idx) {
+        if (((idx >> k) & 1) != (int)value)
+            continue;
+        int j = (idx & ((1 << k) - 1)) | ((idx >> (k + 1)) << k);
+        rs |= ((table >> idx) & 1) << j;
+    }
+    return rs;
+}
+
+inline uint64_t lutLanes(uint16_t table, uint64_t a, uint64_t b, uint64_t c, uint64_t d)
+{
+    // Shannon expansion, a mux tree on a, b, c then d
+    uint64_t m[8];
+    for (int k = 0; k < 8; ++k)
+        m[k] = ((0 - (uint64_t)((table >> (2 * k)) & 1)) & ~a) | ((0 - (uint64_t)((table >> (2 * k + 1)) & 1)) & a);
+    for (int k = 0; k < 4; ++k)
+        m[k] = (m[2 * k] & ~b) | (m[2 * k + 1] & b);
+    for (int k = 0; k < 2; ++k)
+        m[k] = (m[2 * k] & ~c) | (m[2 * k + 1] & c);
+    return (m[0] & ~d) | (m[1] & d);
+}
+
+// Three-valued lanes, one holds the lanes that may be 1 and zero the ones
+// that may be 0, an X lane is in both
+struct TriLanes
+{
+    uint64_t one;
+    uint64_t zero;
+};
+
+inline TriLanes triConst(bool value)
+{
+    return TriLanes{ 0 - (uint64_t)value, (uint64_t)value - 1 };
+}
+
+// s ? b : a, a known result when both sides agree even if s is X
+inline TriLanes triMux(TriLanes s, TriLanes a, TriLanes b)
+{
+    return TriLanes{ (s.zero & a.one) | (s.one & b.one), (s.zero & a.zero) | (s.one & b.zero) };
+}
+
+inline TriLanes lutTri(uint16_t table, TriLanes a, TriLanes b, TriLanes c, TriLanes d)
+{
+    TriLanes m[8];
+    for (int k = 0; k < 8; ++k)
+        m[k] = triMux(a, triConst((table >> (2 * k)) & 1), triConst((table >> (2 * k + 1)) & 1));
+    for (int k = 0; k < 4; ++k)
+        m[k] = triMux(b, m[2 * k], m[2 * k + 1]);
+    for (int k = 0; k < 2; ++k)
+        m[k] = triMux(c, m[2 * k], m[2 * k + 1]);
+    return triMux(d, m[0], m[1]);
+}
+
+// Board storage in chunks doubling in size. Gates never move once a chunk
+// is allocated so indices stay valid while the board grows, and every
+// chunk is released at once. Lookups go through a table of fixed size
+// pages pointing inside the chunks.
+class GateArena
 {
+private:
+    static const int PAGE_BITS = 10;
+    std::vector<LogicalGate *> chunks;
+    std::vector<LogicalGate *> pages;
+    size_t bytes;
+    size_t peak;
 public:
-    int start;
-    int length;
-    int *index;
-    LogicalVector() : start(0), length(0), index(nullptr) {}
-    LogicalVector(int length) : start(-1), length(length)
+    GateArena() : bytes(0), peak(0) {}
+    GateArena(const GateArena &) = delete;
+    GateArena &operator=(const GateArena &) = delete;
+    ~GateArena() { release(); }
+
+    LogicalGate &operator[](GateId idx) const
+    {
+        return pages[(size_t)idx >> PAGE_BITS][(size_t)idx & ((1 << PAGE_BITS) - 1)];
+    }
+
+    size_t size() const { return pages.size() << PAGE_BITS; }
+    size_t memory() const { return bytes; }
+    size_t memoryPeak() const { return peak; }
+
+    void reserve(size_t count)
+    {
+        while (size() < count) {
+            size_t lg = (size_t)1 << (chunks.size() + PAGE_BITS);
+            LogicalGate *chunk = new LogicalGate[lg];
+            chunks.push_back(chunk);
+            for (size_t k = 0; k < lg; k += (size_t)1 << PAGE_BITS)
+                pages.push_back(chunk + k);
+            bytes += lg * sizeof(LogicalGate);
+            if (bytes > peak)
+                peak = bytes;
+        }
+    }
+
+    void release()
+    {
+        for (auto chunk : chunks)
+            delete[] chunk;
+        chunks.clear();
+        pages.clear();
+        bytes = 0;
+    }
+};
+
+// Gate indices of a signal, kept as runs of consecutive gates. Up to
+// INLINE_RUNS runs are stored in place, longer lists go to a shared
+// reference counted block: copies and slices point into it, only set()
+// on a shared block copies it. Entries not set yet are -1.
+struct LogicalVector
+{
+private:
+    static const int INLINE_RUNS = 4;
+    struct Run
     {
-        index = new int[length];
-        for (int i = 0; i < length; ++i)
-            index[i] = -1;
+        GateId start; // -1 for entries not set yet
+        int length;
+    };
+    struct Block
+    {
+        int refs;
+        int size;
+        GateId *entries() { return reinterpret_cast<GateId *>(this + 1); }
+    };
+
+    int runCount; // 0 when the entries are in the block
+    Run runs[INLINE_RUNS];
+    Block *block;
+    int offset;
+
+    static Block *newBlock(int size)
+    {
+        Block *b = static_cast<Block *>(::operator new(sizeof(Block) + (size_t)size * sizeof(GateId)));
+        b->refs = 1;
+        b->size = size;
+        return b;
+    }
+    void releaseBlock()
+    {
+        if (block && --block->refs == 0)
+            ::operator delete(block);
+        block = nullptr;
+    }
+    static bool joins(const Run &a, const Run &b)
+    {
+        return a.start < 0 ? b.start < 0 : b.start == a.start + a.length;
     }
-    LogicalVector(int start, int length) : start(start), length(length), index(nullptr) {}
-    LogicalVector(const LogicalVector &copy) : start(copy.start), length(copy.length), index(nullptr)
+    // Append to the inline runs, false when they are full
+    bool pushRun(Run rn)
     {
-        if (copy.index) {
-            index = new int[length];
+        if (rn.length == 0)
+            return true;
+        if (runCount > 0 && joins(runs[runCount - 1], rn)) {
+            runs[runCount - 1].length += rn.length;
+        } else {
+            if (runCount == INLINE_RUNS)
+                return false;
+            runs[runCount++] = rn;
+        }
+        length += rn.length;
+        return true;
+    }
+    void copyTo(GateId *out) const
+    {
+        if (runCount == 0) {
             for (int i = 0; i < length; ++i)
-                index[i] = copy.index[i];
+                out[i] = block->entries()[offset + i];
+            return;
+        }
+        for (int r = 0; r < runCount; ++r) {
+            for (int k = 0; k < runs[r].length; ++k)
+                *out++ = runs[r].start < 0 ? -1 : runs[r].start + k;
         }
     }
-    LogicalVector(LogicalVector &&move) : start(move.start), length(move.length), index(move.index)
+    // Runs when they fit inline, a new block otherwise
+    void assign(const Run *rs, int n)
     {
-        if (index)
-            move.index = nullptr;
+        LogicalVector tmp;
+        bool fits = true;
+        for (int i = 0; i < n && fits; ++i)
+            fits = tmp.pushRun(rs[i]);
+        if (!fits) {
+            int total = 0;
+            for (int i = 0; i < n; ++i)
+                total += rs[i].length;
+            tmp.runCount = 0;
+            tmp.length = total;
+            tmp.block = newBlock(total);
+            GateId *out = tmp.block->entries();
+            for (int i = 0; i < n; ++i) {
+                for (int k = 0; k < rs[i].length; ++k)
+                    *out++ = rs[i].start < 0 ? -1 : rs[i].start + k;
+            }
+        }
+        *this = std::move(tmp);
+    }
+    bool assignRuns(const GateId *entries, int n)
+    {
+        LogicalVector tmp;
+        for (int i = 0; i < n; ++i) {
+            if (!tmp.pushRun(Run{ entries[i], 1 }))
+                return false;
+        }
+        *this = std::move(tmp);
+        return true;
+    }
+    void assign(const GateId *entries, int n)
+    {
+        if (assignRuns(entries, n))
+            return;
+        LogicalVector tmp;
+        tmp.length = n;
+        tmp.block = newBlock(n);
+        for (int i = 0; i < n; ++i)
+            tmp.block->entries()[i] = entries[i];
+        *this = std::move(tmp);
+    }
+public:
+    int length;
+
+    LogicalVector() : runCount(0), block(nullptr), offset(0), length(0) {}
+    LogicalVector(int length) : runCount(0), block(nullptr), offset(0), length(0)
+    {
+        pushRun(Run{ -1, length });
+    }
+    LogicalVector(GateId start, int length) : runCount(0), block(nullptr), offset(0), length(0)
+    {
+        pushRun(Run{ start, length });
+    }
+    LogicalVector(const LogicalVector &copy)
+        : runCount(copy.runCount), block(copy.block), offset(copy.offset), length(copy.length)
+    {
+        for (int r = 0; r < runCount; ++r)
+            runs[r] = copy.runs[r];
+        if (block)
+            block->refs++;
     }
-    ~LogicalVector() { if (index) delete[] index; }
+    LogicalVector(LogicalVector &&move) noexcept
+        : runCount(move.runCount), block(move.block), offset(move.offset), length(move.length)
+    {
+        for (int r = 0; r < runCount; ++r)
+            runs[r] = move.runs[r];
+        move.runCount = 0;
+        move.block = nullptr;
+        move.length = 0;
+    }
+    ~LogicalVector() { releaseBlock(); }
 
-    LogicalVector& operator=(LogicalVector &&move) noexcept
+    LogicalVector &operator=(LogicalVector &&move) noexcept
     {
-        if (index)
-            delete[] index;
-        start = move.start;
+        if (this == &move)
+            return *this;
+        releaseBlock();
+        runCount = move.runCount;
+        for (int r = 0; r < runCount; ++r)
+            runs[r] = move.runs[r];
+        block = move.block;
+        offset = move.offset;
         length = move.length;
-        index = move.index;
-        if (index)
-            move.index = nullptr;
+        move.runCount = 0;
+        move.block = nullptr;
+        move.length = 0;
         return *this;
     }
 
     LogicalVector &operator=(const LogicalVector &copy)
     {
-        if (index)
-            delete[] index;
-        start = copy.start;
+        if (copy.block)
+            copy.block->refs++;
+        releaseBlock();
+        runCount = copy.runCount;
+        for (int r = 0; r < runCount; ++r)
+            runs[r] = copy.runs[r];
+        block = copy.block;
+        offset = copy.offset;
         length = copy.length;
-        index = copy.index;
-        if (copy.index) {
-            index = new int[length];
-            for (int i = 0; i < length; ++i)
-                index[i] = copy.index[i];
-        }
         return *this;
     }
 
-    bool operator==(const LogicalVector &other)
+    bool operator==(const LogicalVector &other) const
     {
         if (other.length != length)
             return false;
@@ -99,78 +367,238 @@ public:
 
     LogicalVector &operator+=(const LogicalVector &copy)
     {
-        int *arr = new int[length + copy.length];
-        for (int i = 0; i < length; ++i)
-            arr[i] = (*this)[i];
-        if (index)
-            delete[] index;
-        for (int i = 0; i < copy.length; ++i)
-            arr[length + i] = copy[i];
-        start = -1;
-        length += copy.length;
-        index = arr;
+        if (copy.length == 0)
+            return *this;
+        if ((runCount > 0 || length == 0) && copy.runCount > 0) {
+            Run rs[INLINE_RUNS * 2];
+            int n = 0;
+            for (int r = 0; r < runCount; ++r)
+                rs[n++] = runs[r];
+            for (int r = 0; r < copy.runCount; ++r)
+                rs[n++] = copy.runs[r];
+            assign(rs, n);
+            return *this;
+        }
+        std::vector<GateId> entries(length + copy.length);
+        copyTo(entries.data());
+        copy.copyTo(entries.data() + length);
+        assign(entries.data(), (int)entries.size());
         return *this;
     }
 
-    const int operator[] (int idx) const
+    const GateId operator[] (int idx) const
     {
         if (idx < 0 || idx >= length)
             throw "Out of range";
-        if (index == nullptr)
-            return start + idx;
-        return index[idx];
+        if (runCount == 0)
+            return block->entries()[offset + idx];
+        for (int r = 0; ; ++r) {
+            if (idx < runs[r].length)
+                return runs[r].start < 0 ? -1 : runs[r].start + idx;
+            idx -= runs[r].length;
+        }
     }
 
-    void set(int idx, int value)
+    void set(int idx, GateId value)
     {
-        if (idx < 0 || idx >= length)
-            throw "Out of range";
-        if (index[idx] != -1 || index == nullptr)
+        if ((*this)[idx] != -1)
             throw "Already set";
-        index[idx] = value;
+        if (runCount > 0) {
+            // Split the run not set yet around the entry
+            Run rs[INLINE_RUNS + 2];
+            int n = 0;
+            for (int r = 0; r < runCount; ++r) {
+                if (idx >= 0 && idx < runs[r].length) {
+                    rs[n++] = Run{ -1, idx };
+                    rs[n++] = Run{ value, 1 };
+                    rs[n++] = Run{ -1, runs[r].length - idx - 1 };
+                } else {
+                    rs[n++] = runs[r];
+                }
+                idx -= runs[r].length;
+            }
+            assign(rs, n);
+            return;
+        }
+        if (block->refs > 1) {
+            LogicalVector tmp;
+            tmp.length = length;
+            tmp.block = newBlock(length);
+            copyTo(tmp.block->entries());
+            *this = std::move(tmp);
+        }
+        block->entries()[offset + idx] = value;
     }
-    LogicalVector sub(int from, int to)
+    // Move the entries of a block back inline when they fit
+    void pack()
+    {
+        if (runCount == 0 && block)
+            assignRuns(block->entries() + offset, length);
+    }
+
+    LogicalVector sub(int from, int to) const
     {
         if (from < 0 || to >= length || from > to)
             throw "Out of range";
         int lg = to - from + 1;
-        if (index == nullptr)
-            return LogicalVector(start + from, lg);
-        if (lg == 1 && index[from] != -1)
-            return LogicalVector(index[from], lg);
-        LogicalVector rs(lg);
-        for (int i = 0; i < lg; ++i)
-            rs.index[i] = index[from + i];
+        LogicalVector rs;
+        if (runCount > 0) {
+            for (int r = 0; r < runCount; ++r) {
+                int lo = std::max(from, 0);
+                int hi = std::min(to + 1, runs[r].length);
+                if (lo < hi)
+                    rs.pushRun(Run{ runs[r].start < 0 ? -1 : runs[r].start + lo, hi - lo });
+                from -= runs[r].length;
+                to -= runs[r].length;
+            }
+            return rs;
+        }
+        // Short slices are copied inline, others share the block
+        if (rs.assignRuns(block->entries() + offset + from, lg))
+            return rs;
+        rs.block = block;
+        rs.block->refs++;
+        rs.offset = offset + from;
+        rs.length = lg;
         return rs;
     }
 };
 
+// Register, RAM or ROM simulated natively after the gates of a tick. The
+// pins are also named vectors "$<cell>.<pin>" so optimize() and rebuild()
+// renumber them with the board, each bit of q is a gate of the cell opcode.
+struct MacroCell
+{
+    GateOpcode opcode;
+    LogicalVector d;
+    LogicalVector addr;
+    LogicalVector we;
+    LogicalVector clk;
+    LogicalVector q;
+    std::vector<uint64_t> memory; // Ram and Rom words
+    std::vector<uint64_t> next;   // q sampled at the edge, committed after
+    bool rise;
+    bool lastClk;
+    uint64_t lastLanes;
+    TriLanes lastTri;
+};
+
 class UnitBuilder
 {
 private:
-    LogicalGate *board;
-    int length;
-    int pen;
+    GateArena board;
+    GateId pen;
     std::map<std::string, LogicalVector> vectors;
     int maxUsage;
     int maxDepth;
+    // Structural hashing, open addressing on (opcode, pin1, pin2)
+    bool hashing;
+    std::vector<GateId> hashSlots;
+    size_t hashCount;
+
+    std::vector<MacroCell> cells;
+    bool cellsBound;
+    // One-hot terms of the selectors lowered to a decoder
+    std::map<std::vector<GateId>, std::vector<GateId>> decoders;
+    friend class SelectEmit;
+
+    // Gates evaluated by a tick while there are probes, in board order
+    std::vector<GateId> probes;
+    std::vector<GateId> cone;
+    std::vector<char> inCone;
+    bool coneValid;
+    void buildCone();
+    void extendCone(GateId idx, bool lanes);
+    char dumpValue(GateId idx) const;
+    template <bool Ordered> void evalValues(const GateId *order, size_t count);
+    template <bool Ordered> void evalLanes(const GateId *order, size_t count);
+
+    // Incremental ticks, readers of gate i are fanouts[fanoutStart[i]..]
+    bool incremental;
+    bool settled;
+    std::vector<GateId> fanoutStart;
+    std::vector<GateId> fanouts;
+    std::vector<GateId> stateful;
+    std::vector<GateId> touched;
+    std::vector<char> dirty;
+    uint64_t skipped;
+    void buildFanouts();
+    void tickIncremental();
+
+    // Planes of every gate in X mode, new gates start as X
+    bool xmode;
+    std::vector<TriLanes> tri;
+    template <bool Ordered> void evalTri(const GateId *order, size_t count);
+    void tickCellTri();
+
+    LogicalVector addCell(GateOpcode opcode, int width, const LogicalVector &d, const LogicalVector &addr,
+        const LogicalVector &we, const LogicalVector &clk, std::vector<uint64_t> memory);
+    void bindCells();
+    uint64_t cellWord(const LogicalVector &vc) const;
+    void tickCells();
+    void tickCellLanes();
+
+    static bool isHashable(GateOpcode opcode);
+    size_t hashSlot(const LogicalGate &key) const;
+    void hashInsert(GateId idx);
 public:
-    UnitBuilder(int size);
+    UnitBuilder(GateId reserve = 0);
     ~UnitBuilder();
 
-    int addGate(GateOpcode opcode, int pin1 = -1, int pin2 = -1);
-    LogicalVector addGate(GateOpcode opcode, const std::string pins1, int pin2 = -1);
+    // When enabled, combinational gates already on the board with the same
+    // opcode and inputs are returned instead of being added again.
+    void setHashing(bool enable);
+    GateId addGate(GateOpcode opcode, GateId pin1 = -1, GateId pin2 = -1)
+    {
+        return addGate(opcode, pin1, pin2, -1);
+    }
+    // Mux, Maj3 and Lut4, pins not used are -1 and read as 0 by a Lut4
+    GateId addGate(GateOpcode opcode, GateId pin1, GateId pin2, GateId pin3, GateId pin4 = -1, uint16_t table = 0);
+    LogicalVector addGate(GateOpcode opcode, const std::string pins1, GateId pin2 = -1);
     LogicalVector addGate(GateOpcode opcode, const std::string pins1, const std::string pins2);
-    LogicalVector addGate(GateOpcode opcode, LogicalVector vc1, int pin2 = -1);
-    LogicalVector addGate(GateOpcode opcode, LogicalVector vc1, LogicalVector vc2);
-    LogicalVector addGate(GateOpcode opcode, const std::string pins1, LogicalVector vc2);
-    LogicalVector addSelect(int idx, LogicalVector vc1, LogicalVector vc2);
-    LogicalVector addSelect(int idx, int pin1, int pin2);
-    int addGateSum(GateOpcode opcode, LogicalVector vc);
+    LogicalVector addGate(GateOpcode opcode, const LogicalVector &vc1, GateId pin2 = -1);
+    LogicalVector addGate(GateOpcode opcode, const LogicalVector &vc1, const LogicalVector &vc2);
+    LogicalVector addGate(GateOpcode opcode, const std::string pins1, const LogicalVector &vc2);
+    LogicalVector addSelect(GateId idx, const LogicalVector &vc1, const LogicalVector &vc2);
+    LogicalVector addSelect(GateId idx, GateId pin1, GateId pin2);
+    // Entry k when sel reads k, lowered either to a Mux tree or to an
+    // AND-OR plane over the decoder of sel, shared by all the selects on
+    // it. The one adding fewer gates is built, then the shallower one.
+    LogicalVector addSelect(const LogicalVector &sel, const std::vector<LogicalVector> &entries);
+    // Parallel-prefix adder, cin -1 for none. Returns the sum, carries get
+    // the carry out of every bit, the last one is the carry out.
+    LogicalVector addAdd(const LogicalVector &a, const LogicalVector &b, GateId cin,
+        LogicalVector *carries = nullptr, PrefixNetwork network = PrefixNetwork::KoggeStone);
+    // Barrel shifter, one Mux stage per bit of n. Counts past the width
+    // give zeros or the sign, rotations wrap around.
+    LogicalVector addShift(const LogicalVector &x, const LogicalVector &n, ShiftMode mode);
+    // a == b, a < b unsigned and a < b signed, in this order
+    LogicalVector addCompare(const LogicalVector &a, const LogicalVector &b);
+    // Gate already on the board with this opcode and inputs, -1 if none
+    GateId findGate(GateOpcode opcode, GateId pin1, GateId pin2, GateId pin3 = -1) const;
+    GateId addGateSum(GateOpcode opcode, const LogicalVector &vc);
+    // Copy the board and macro cells of another builder. Fix gates of the
+    // named vectors in ports read the bound gates instead, other ones are
+    // copied. Returns the other named vectors renumbered.
+    std::map<std::string, LogicalVector> addInstance(const UnitBuilder &unit,
+        const std::map<std::string, LogicalVector> &ports);
+
+    // Macro cells sampled on the rising edge of clk. Ram and Rom words are
+    // at most 64 bits, q reads the word at addr before a write. Pins with
+    // entries not set yet have to be bound with bindCell() before a tick.
+    LogicalVector addReg(const LogicalVector &d, const LogicalVector &clk);
+    LogicalVector addRam(int words, const LogicalVector &addr, const LogicalVector &d,
+        const LogicalVector &we, const LogicalVector &clk);
+    // One hexadecimal word per line, '#' starts a comment
+    LogicalVector addRom(const std::string &path, int width, const LogicalVector &addr, const LogicalVector &clk);
+    void bindCell(int cell, const std::string &pin, const LogicalVector &vc);
+    int cellCount() const { return (int)cells.size(); }
+    uint64_t readCell(int cell, int addr) const;
+    void writeCell(int cell, int addr, uint64_t value);
 
     LogicalVector addInput(const std::string &name, int size)
     {
-        int start = pen;
+        GateId start = pen;
         for (int i = 0; i < size; ++i)
             addGate(GateOpcode::Fix);
         LogicalVector vc(start, size);
@@ -189,16 +617,75 @@ public:
         return vectors[name];
     }
 
-    void tick();
+    GateId count() const { return pen; }
+    // For the engines keeping 32-bit pins, throws past their range
+    int count32() const
+    {
+        if (pen > INT32_MAX)
+            throw "Out of gates";
+        return (int)pen;
+    }
+    int depth() const { return maxDepth; }
+    const LogicalGate &gate(GateId idx) const { return board[idx]; }
+    // Bytes held by the board now and at most since it was built
+    size_t memory() const { return board.memory(); }
+    size_t memoryPeak() const { return board.memoryPeak(); }
+    const std::map<std::string, LogicalVector> &namedVectors() const { return vectors; }
 
+    // Fold constants, drop gates outside the cone of the named vectors and
+    // renumber the board. Indices taken before must be looked up again.
+    void optimize();
+    // Replace the board, pins of each gate must refer to earlier entries.
+    // Values and lanes are kept so stateful gates don't lose their state.
+    void rebuild(const std::vector<LogicalGate> &gates, const std::map<std::string, LogicalVector> &named);
 
-    void set(int idx, bool value);
+    void tick();
+    // Ticks only evaluate the fan-in of the probes, of the stateful gates,
+    // of the macro cell pins and of the gates fed by a macro cell q. get()
+    // on a gate outside of it adds the gate to the probes. No probes evaluates the whole board, rebuild()
+    // and optimize() drop them.
+    void setProbes(const std::vector<LogicalVector> &outputs);
+    GateId coneSize() const { return probes.empty() ? pen : (GateId)cone.size(); }
+    // After a full tick, tick() only evaluates the gates reading an input
+    // changed by set() since the last tick, a macro cell q or a gate whose
+    // value changed, from the Clk and RS gates on. tickLanes() is not
+    // affected.
+    void setIncremental(bool enable);
+    // Gates not evaluated by the incremental ticks since enabled
+    uint64_t skippedGates() const { return skipped; }
+
+    void set(GateId idx, bool value);
     void setU8(LogicalVector vc, unsigned value)
     {
         for (int i = 0; i < 8; ++i)
-            board[vc[i]].value = (value >> i) & 1;
+            set(vc[i], (value >> i) & 1);
+    }
+    bool get(GateId idx);
+
+    // Bit-parallel mode, each bit of a gate word is an independent stimulus
+    static const int LANES = 64;
+    void tickLanes();
+    void setLanes(GateId idx, uint64_t lanes);
+    uint64_t getLanes(GateId idx);
+    void setLanes(LogicalVector vc, const uint64_t *values, int count = LANES);
+    void getLanes(LogicalVector vc, uint64_t *values, int count = LANES);
+    void setU8Lanes(LogicalVector vc, const unsigned *values, int count = LANES)
+    {
+        for (int i = 0; i < 8; ++i) {
+            uint64_t word = 0;
+            for (int l = 0; l < count; ++l)
+                word |= (uint64_t)((values[l] >> i) & 1) << l;
+            setLanes(vc[i], word);
+        }
     }
-    bool get(int idx);
+
+    // X mode, tickLanes() runs on 0/1/X lanes. Every gate starts as X and
+    // RS gates set and reset at once give X, so state never initialized
+    // shows up on the outputs. setLanes() gives known lanes, getLanes()
+    // reads X as 0. rebuild() and optimize() set everything back to X.
+    void setXMode(bool enable);
+    void setUnknown(GateId idx, uint64_t lanes);
+    uint64_t getUnknown(GateId idx);
 
     void dump();
     void dump2();
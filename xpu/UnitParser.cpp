@@ -1,42 +1,56 @@
 #include "UnitParser.h"
 #include "Expression.h"
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <new>
 #include <vector>
 
-std::string string_trim(const std::string &str)
+// Value of the symbols which are not constants
+static const int NO_CONSTANT = INT_MIN;
+
+// Views into the line, nothing is copied. Reading past the end gives '\0'
+static char at(std::string_view str, size_t k = 0)
 {
-    int s = 0;
-    int e = str.size() - 1;
-    while (str[s] == ' ')
+    return k < str.size() ? str[k] : '\0';
+}
+
+static std::string_view string_trim(std::string_view str)
+{
+    size_t s = 0;
+    size_t e = str.size();
+    while (s < e && (str[s] == ' ' || str[s] == '\t'))
         s++;
-    while (e > 0 && str[e] == ' ')
+    while (e > s && (str[e - 1] == ' ' || str[e - 1] == '\t' || str[e - 1] == '\r'))
         e--;
-    return str.substr(s, e - s + 1);
+    return str.substr(s, e - s);
 }
 
-std::string string_word(std::string &str)
+static std::string_view string_word(std::string_view &str)
 {
-    int s = 0;
-    while (std::isalnum(str[s]) || str[s] == '_')
+    size_t s = 0;
+    while (s < str.size() && (std::isalnum((unsigned char)str[s]) || str[s] == '_'))
         s++;
     auto wrd = str.substr(0, s);
-    if (s >= str.size())
-        str = "";
-    else
-        str = string_trim(str.substr(s));
+    str = string_trim(str.substr(s));
     return wrd;
 }
 
-int string_number(std::string &str)
+static int string_number(std::string_view &str)
 {
-    int s = 0;
-    while (std::isdigit(str[s]))
-        s++;
-    auto wrd = str.substr(0, s);
-    if (s >= str.size())
-        str = "";
-    else
-        str = string_trim(str.substr(s));
-    return std::strtol(wrd.c_str(), NULL, 10);
+    size_t s = 0;
+    int value = 0;
+    while (s < str.size() && std::isdigit((unsigned char)str[s]))
+        value = value * 10 + (str[s++] - '0');
+    str = string_trim(str.substr(s));
+    return value;
+}
+
+static void expect(std::string_view &ln, char ch)
+{
+    if (at(ln) != ch)
+        throw ch == ',' ? "Expected ','" : (ch == '(' ? "Expected '('" : "Expected ')'");
+    ln = string_trim(ln.substr(1));
 }
 
 // -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
@@ -50,10 +64,10 @@ public:
 public:
     LogicNode() {}
     LogicNode(GateOpcode opcode, UnitBuilder *builder) : opcode(opcode), builder(builder) {}
-    LogicNode(LogicalVector vector, UnitBuilder *builder) : opcode(GateOpcode::Fix), vector(vector), builder(builder) {}
+    LogicNode(LogicalVector vector, UnitBuilder *builder) : opcode(GateOpcode::Fix), vector(std::move(vector)), builder(builder) {}
     int priority() { return opcode == GateOpcode::Fix ? 0 : (opcode == GateOpcode::Not ? 1 : 2); }
     int operands() { return opcode == GateOpcode::Fix ? 0 : (opcode == GateOpcode::Not ? 1 : 2); }
-    int children(const std::vector<LogicNode> &childs)
+    void children(const std::vector<LogicNode> &childs)
     {
         if (opcode == GateOpcode::Fix)
             throw "";
@@ -64,33 +78,68 @@ public:
     }
 };
 
+// Operators of a LOOP line, added to the code when they are reduced so
+// the code comes out in postfix order
+class LoopNode
+{
+public:
+    GateOpcode opcode;
+    std::vector<LoopInstr> *code;
+public:
+    LoopNode() {}
+    LoopNode(GateOpcode opcode, std::vector<LoopInstr> *code) : opcode(opcode), code(code) {}
+    int priority() { return opcode == GateOpcode::Fix ? 0 : (opcode == GateOpcode::Not ? 1 : 2); }
+    int operands() { return opcode == GateOpcode::Fix ? 0 : (opcode == GateOpcode::Not ? 1 : 2); }
+    void children(const std::vector<LoopNode> &)
+    {
+        if (opcode == GateOpcode::Fix)
+            throw "";
+        code->push_back(LoopInstr{ opcode, false, {} });
+    }
+};
+
 // -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
 UnitParser::UnitParser(const std::string &path)
-    : rd(path, std::ios::in), builder(5000)
+    : source(new SourceFile(path)), offset(0), body(nullptr), cursor(0), root(this), pool(nullptr), task(0), failedAt(nullptr)
 {
+    loopIndex = symbol("i");
+    auto sep = path.find_last_of("/\\");
+    if (sep != std::string::npos)
+        folder = path.substr(0, sep + 1);
+    builder.setHashing(true);
 }
 
-LogicalVector UnitParser::parseLoop(int loop, const std::string &name, const std::string &name2)
+UnitParser::UnitParser(UnitParser *root, const BlockDef &def, const std::vector<int> &values, int task)
+    : offset(0), folder(root->folder), body(&def.lines), cursor(0), root(root), pool(nullptr), task(task), failedAt(nullptr)
 {
-    std::vector<std::string> txt;
-    for (;;) {
-        auto ln = nextLine();
-        if (ln == "END")
-            break;
-        txt.push_back(ln);
-    }
-    LogicalVector backup = vectors[name];
+    builder.setHashing(true);
+    loopIndex = symbol("i");
+    for (size_t i = 0; i < values.size(); ++i)
+        setConstant(symbol(def.params[i]), values[i]);
+}
+
+LogicalVector UnitParser::parseLoop(int loop, std::string_view name, std::string_view name2)
+{
+    std::vector<LoopLine> body;
+    compileLoop(body);
+    SymbolId carry = symbol(name);
+    return runLoop(body, loop, carry, symbol(name2));
+}
+
+LogicalVector UnitParser::runLoop(const std::vector<LoopLine> &body, int loop, SymbolId carry, SymbolId result)
+{
+    LogicalVector backup = vectors[carry];
     for (int i = 0; i < loop; ++i) {
-        vectors[name2] = LogicalVector(backup.length);
-        constantes["i"] = i;
-        for (auto ln : txt)
-            parseLine(ln);
-        vectors[name] = vectors[name2];
+        vectors[result] = LogicalVector(backup.length);
+        setConstant(loopIndex, i);
+        for (auto &line : body)
+            runLine(line);
+        vectors[carry] = vectors[result];
     }
-    vectors[name] = backup;
-    constantes.erase("i");
-    return vectors[name2];
+    vectors[carry] = std::move(backup);
+    setConstant(loopIndex, NO_CONSTANT);
+    return vectors[result];
 }
 
 LogicalVector UnitParser::parseSelect(LogicalVector vc)
@@ -100,44 +149,28 @@ LogicalVector UnitParser::parseSelect(LogicalVector vc)
         auto ln = nextLine();
         if (ln == "END")
             break;
-        auto vn = parseStatement(ln, "");
-        mplx.push_back(vn);
-    }
-
-    int sz = 1 << vc.length;
-    if (sz != mplx.size())
-        throw "Incorrect";
-
-    for (;;) {
-        std::vector<LogicalVector> res;
-        for (int i = 0, n = mplx.size(); i < n; i += 2) {
-            auto v1 = mplx[i];
-            auto v2 = mplx[i + 1];
-            if (v1 == v2) {
-                res.push_back(v1);
-            } else {
-                auto vr = builder.addSelect(vc[0], v1, v2);
-                res.push_back(vr);
-            }
+        try {
+            mplx.push_back(parseStatement(ln, ""));
+        } catch (const char *) {
+            fail(ln);
+            throw;
         }
-        mplx = res;
-        res.clear();
-        if (vc.length == 1)
-            break;
-        vc = vc.sub(1, vc.length - 1);
     }
 
-    std::cout << "SELECT (" << sz << ", " << mplx[0].length << ")" << std::endl;
-    return mplx[0];
+    if ((size_t)1 << vc.length != mplx.size())
+        throw "Incorrect";
+    auto rs = builder.addSelect(vc, mplx);
+    std::cout << "SELECT (" << mplx.size() << ", " << rs.length << ")" << std::endl;
+    return rs;
 }
 
-LogicalVector UnitParser::parseLoopEntry(std::string &ln, const std::string &name)
+LogicalVector UnitParser::parseLoopEntry(std::string_view &ln, std::string_view name)
 {
-    if (ln[0] != '(')
+    if (at(ln) != '(')
         throw "Expected '('";
     ln = string_trim(ln.substr(1));
-    int lp = string_number(ln);
-    if (ln[0] != ')')
+    int lp = readNumber(ln);
+    if (at(ln) != ')')
         throw "Expected ')'";
     ln = string_trim(ln.substr(1));
     auto wrd = string_word(ln);
@@ -145,71 +178,205 @@ LogicalVector UnitParser::parseLoopEntry(std::string &ln, const std::string &nam
     return parseLoop(lp, wrd, name);
 }
 
-LogicalVector UnitParser::parseSelectEntry(std::string &ln)
+LogicalVector UnitParser::parseSelectEntry(std::string_view &ln)
 {
-    if (ln[0] != '(')
+    if (at(ln) != '(')
         throw "Expected '('";
     ln = string_trim(ln.substr(1));
     auto wrd = string_word(ln);
     auto vs = readVector(wrd, ln);
-    if (ln[0] != ')')
+    if (at(ln) != ')')
         throw "Expected ')'";
     ln = string_trim(ln.substr(1));
     return parseSelect(vs);
 }
 
-LogicalVector UnitParser::parseVecEntry(std::string &ln, GateOpcode op)
+LogicalVector UnitParser::parseVecEntry(std::string_view &ln, GateOpcode op)
 {
-    if (ln[0] != '(') {
-        int idx = builder.addGate(op);
+    if (at(ln) != '(') {
+        GateId idx = builder.addGate(op);
         return LogicalVector(idx, 1);
     }
     ln = string_trim(ln.substr(1));
-    int lg = string_number(ln);
-    if (ln[0] != ')')
+    int lg = readNumber(ln);
+    if (at(ln) != ')')
         throw "Expected ')'";
-    int idx = builder.addGate(op);
+    GateId idx = builder.addGate(op);
     auto vc = LogicalVector(lg);
     for (int i = 0; i < lg; ++i)
         vc.set(i, idx);
     return vc;
 }
 
-LogicalVector UnitParser::readVectors(std::string &ln)
+// REG(d, clk), RAM(words, addr, d, we, clk) or ROM(path, width, addr, clk)
+LogicalVector UnitParser::parseCellEntry(std::string_view &ln, GateOpcode op)
+{
+    static const char *regPins[] = { "d", "clk" };
+    static const char *ramPins[] = { "addr", "d", "we", "clk" };
+    static const char *romPins[] = { "addr", "clk" };
+    expect(ln, '(');
+    std::string path;
+    int size = 0;
+    if (op == GateOpcode::Rom) {
+        auto sep = ln.find(',');
+        if (sep == std::string_view::npos)
+            throw "Expected ','";
+        path = std::string(string_trim(ln.substr(0, sep)));
+        if (at(path) != '/' && path.find(':') == std::string::npos)
+            path = folder + path;
+        ln = ln.substr(sep);
+        expect(ln, ',');
+    }
+    if (op != GateOpcode::Reg) {
+        size = readNumber(ln);
+        expect(ln, ',');
+    }
+
+    const char **names = op == GateOpcode::Reg ? regPins : (op == GateOpcode::Ram ? ramPins : romPins);
+    int count = op == GateOpcode::Ram ? 4 : 2;
+    LogicalVector pins[4];
+    std::string_view texts[4];
+    for (int i = 0; i < count; ++i) {
+        if (i > 0)
+            expect(ln, ',');
+        pins[i] = readCellPin(ln, texts[i]);
+    }
+    expect(ln, ')');
+
+    int cell = builder.cellCount();
+    LogicalVector q;
+    if (op == GateOpcode::Reg)
+        q = builder.addReg(pins[0], pins[1]);
+    else if (op == GateOpcode::Ram)
+        q = builder.addRam(size, pins[0], pins[1], pins[2], pins[3]);
+    else
+        q = builder.addRom(path, size, pins[0], pins[1]);
+
+    // Registers usually read logic declared after them
+    for (int i = 0; i < count; ++i) {
+        for (int k = 0; k < pins[i].length; ++k) {
+            if (pins[i][k] < 0) {
+                pending.push_back(PendingPin{ cell, names[i], texts[i] });
+                break;
+            }
+        }
+    }
+    return q;
+}
+
+// ADD(a, b) or ADD(a, b, cin), the carry out of every bit is named
+// <name>_Cr. SHIFT(x, n, mode) with mode SHL, SHR, SAR, ROL or ROR.
+// CMP(a, b) gives [a == b, a < b unsigned, a < b signed].
+LogicalVector UnitParser::parseArithEntry(std::string_view &ln, std::string_view op, std::string_view name)
+{
+    expect(ln, '(');
+    std::string_view text;
+    auto a = readCellPin(ln, text);
+    expect(ln, ',');
+    auto b = readCellPin(ln, text);
+    LogicalVector rs;
+    if (op == "SHIFT") {
+        expect(ln, ',');
+        auto mode = string_word(ln);
+        ShiftMode shift;
+        if (mode == "SHL")
+            shift = ShiftMode::Shl;
+        else if (mode == "SHR")
+            shift = ShiftMode::Shr;
+        else if (mode == "SAR")
+            shift = ShiftMode::Sar;
+        else if (mode == "ROL")
+            shift = ShiftMode::Rol;
+        else if (mode == "ROR")
+            shift = ShiftMode::Ror;
+        else
+            throw "Invalid";
+        rs = builder.addShift(a, b, shift);
+    } else if (op == "CMP") {
+        rs = builder.addCompare(a, b);
+    } else {
+        GateId cin = -1;
+        if (at(ln) == ',') {
+            expect(ln, ',');
+            auto c = readCellPin(ln, text);
+            if (c.length != 1)
+                throw "Invalid";
+            cin = c[0];
+        }
+        LogicalVector carries;
+        rs = builder.addAdd(a, b, cin, &carries);
+        if (name != "")
+            vectors[symbol(std::string(name) + "_Cr")] = carries;
+    }
+    expect(ln, ')');
+    return rs;
+}
+
+LogicalVector UnitParser::readCellPin(std::string_view &ln, std::string_view &text)
+{
+    std::string_view from = ln;
+    LogicalVector vc;
+    if (at(ln) == '[') {
+        vc = readVectors(ln);
+        if (at(ln) != ']')
+            throw "Expected ']'";
+        ln = string_trim(ln.substr(1));
+    } else {
+        vc = readVector(string_word(ln), ln);
+    }
+    text = string_trim(from.substr(0, from.size() - ln.size()));
+    return vc;
+}
+
+void UnitParser::bindPending()
+{
+    for (auto &pin : pending) {
+        std::string_view ln = pin.text;
+        std::string_view text;
+        try {
+            builder.bindCell(pin.cell, pin.pin, readCellPin(ln, text));
+        } catch (const char *) {
+            fail(pin.text);
+            throw;
+        }
+    }
+    pending.clear();
+}
+
+LogicalVector UnitParser::readVectors(std::string_view &ln)
 {
     ln = string_trim(ln.substr(1));
     LogicalVector sum;
     auto wrd = string_word(ln);
     for (; wrd != ""; wrd = string_word(ln)) {
         sum += readVector(wrd, ln);
-        if (ln[0] == ']')
+        if (at(ln) == ']')
             break;
-        else if (ln[0] == ',')
+        else if (at(ln) == ',')
             ln = string_trim(ln.substr(1));
     }
     return sum;
 }
 
-LogicalVector UnitParser::readVector(const std::string &wrd, std::string &ln)
+LogicalVector UnitParser::readVector(std::string_view wrd, std::string_view &ln)
 {
-    auto vc = vectors[wrd];
-    if (ln[0] == '.') {
-        ln = ln.substr(1);
-        int idxf = readNumber(ln);
-        int idxt = idxf;
-        if (ln[0] == '.' && ln[1] == '.') {
-            ln = ln.substr(2);
-            idxt = readNumber(ln);
-        }
-        vc = vc.sub(idxf, idxt);
+    const LogicalVector &vc = findVector(wrd);
+    if (at(ln) != '.')
+        return vc;
+    ln = ln.substr(1);
+    int idxf = readNumber(ln);
+    int idxt = idxf;
+    if (at(ln) == '.' && at(ln, 1) == '.') {
+        ln = ln.substr(2);
+        idxt = readNumber(ln);
     }
-    return vc;
+    return vc.sub(idxf, idxt);
 }
 
-LogicalVector UnitParser::parseStatement(std::string &ln, const std::string &name)
+LogicalVector UnitParser::parseStatement(std::string_view &ln, std::string_view name)
 {
     Expression<LogicNode> expr;
-    if (ln[0] == '[')
+    if (at(ln) == '[')
         return readVectors(ln);
     auto wrd = string_word(ln);
     if (wrd == "LOOP")
@@ -220,6 +387,16 @@ LogicalVector UnitParser::parseStatement(std::string &ln, const std::string &nam
         return parseVecEntry(ln, GateOpcode::One);
     else if (wrd == "ZERO")
         return parseVecEntry(ln, GateOpcode::Zero);
+    else if (wrd == "REG")
+        return parseCellEntry(ln, GateOpcode::Reg);
+    else if (wrd == "RAM")
+        return parseCellEntry(ln, GateOpcode::Ram);
+    else if (wrd == "ROM")
+        return parseCellEntry(ln, GateOpcode::Rom);
+    else if ((wrd == "ADD" || wrd == "SHIFT" || wrd == "CMP") && at(ln) == '(')
+        return parseArithEntry(ln, wrd, name);
+    else if (at(ln) == '(' && findBlock(wrd))
+        return parseInstance(ln, wrd, name);
 
 
     for (; wrd != ""; wrd = string_word(ln)) {
@@ -239,52 +416,264 @@ LogicalVector UnitParser::parseStatement(std::string &ln, const std::string &nam
             op = GateOpcode::Not;
 
         if (op != GateOpcode::Fix) {
-            if (ln[0] != '[') {
+            if (at(ln) != '[') {
                 expr.addOperator(LogicNode(op, &builder));
                 continue;
             }
             auto vc = readVectors(ln);
-            int idx = builder.addGateSum(op, vc);
-            vc = LogicalVector(idx, 1);
-            expr.addOperand(LogicNode(vc, &builder));
+            GateId idx = builder.addGateSum(op, vc);
+            expr.addOperand(LogicNode(LogicalVector(idx, 1), &builder));
 
         } else {
-            auto vc = readVector(wrd, ln);
-            expr.addOperand(LogicNode(vc, &builder));
+            expr.addOperand(LogicNode(readVector(wrd, ln), &builder));
         }
     }
-    auto nd = expr.compile();
-    return nd.vector;
+    return std::move(expr.compile().vector);
 }
 
-int UnitParser::readNumber(std::string &str)
+int UnitParser::readNumber(std::string_view &str)
 {
-    if (std::isdigit(str[0]))
+    if (std::isdigit(at(str)))
         return string_number(str);
-    auto tx = string_word(str);
-    auto it = constantes.find(tx);
-    if (it == constantes.end())
-        throw "Undefined";
-    return it->second;
+    return findConstant(symbols.find(string_word(str)));
 }
 
-void UnitParser::parseBlock(const std::string &name)
+// BLOCK name or BLOCK name(param, ...), the lines up to the matching END
+// are kept. Blocks never instantiated and without parameters are the
+// design, they are inlined at the end of the file.
+void UnitParser::parseBlock(std::string_view &ln)
 {
+    auto name = string_word(ln);
+    if (name == "")
+        throw "Expected name";
+    if (findBlock(name))
+        throw "Redefined";
+    BlockDef def;
+    if (at(ln) == '(') {
+        do {
+            ln = string_trim(ln.substr(1));
+            def.params.emplace_back(string_word(ln));
+            if (def.params.back() == "")
+                throw "Expected name";
+        } while (at(ln) == ',');
+        expect(ln, ')');
+    }
+
+    readSection(def.lines, &def.uses);
+    std::unique_lock<std::mutex> guard(root->lock);
+    if (!root->blocks.emplace(std::string(name), std::move(def)).second)
+        throw "Redefined";
+    root->blockOrder.emplace_back(name);
+}
+
+// Lines up to the END closing the current statement, the blocks they
+// instantiate are marked
+void UnitParser::readSection(std::vector<std::string_view> &lines, std::vector<std::string_view> *uses)
+{
+    int level = 0;
     for (;;) {
-        auto ln = nextLine();
-        if (ln == "END")
+        auto txt = nextLine();
+        if (txt == "END" && level-- == 0)
+            break;
+        lines.push_back(txt);
+        std::string_view rest = txt;
+        auto wrd = string_word(rest);
+        auto eq = txt.find('=');
+        if (wrd != "BLOCK" && eq != std::string_view::npos) {
+            rest = string_trim(txt.substr(eq + 1));
+            wrd = string_word(rest);
+        }
+        if (wrd == "BLOCK" || wrd == "LOOP" || wrd == "SELECT")
+            level++;
+        else if (at(rest) == '(') {
+            if (uses != nullptr)
+                uses->push_back(wrd);
+            std::unique_lock<std::mutex> guard(root->lock);
+            root->instantiated.emplace(wrd);
+        }
+    }
+}
+
+const BlockDef *UnitParser::findBlock(std::string_view name)
+{
+    std::unique_lock<std::mutex> guard(root->lock);
+    auto it = root->blocks.find(name);
+    return it == root->blocks.end() ? nullptr : &it->second;
+}
+
+// Each block is elaborated once per set of parameters, instances copy it.
+// A template started by another task is waited for, unless that task
+// waits, maybe through others, for one of ours: this is a recursion.
+UnitParser &UnitParser::blockTemplate(std::string_view name, const std::vector<int> &values, int task)
+{
+    auto &def = *findBlock(name);
+    if (values.size() != def.params.size())
+        throw "Invalid";
+    std::string key(name);
+    for (int v : values)
+        key += "," + std::to_string(v);
+
+    std::unique_lock<std::mutex> guard(root->lock);
+    for (;;) {
+        auto it = root->templates.find(key);
+        if (it == root->templates.end())
             break;
-        parseLine(ln);
+        if (it->second.unit)
+            return *it->second.unit;
+        int holder = it->second.owner;
+        while (holder != task) {
+            auto w = root->waiting.find(holder);
+            if (w == root->waiting.end())
+                break;
+            auto next = root->templates.find(w->second);
+            if (next == root->templates.end())
+                break;
+            holder = next->second.owner;
+        }
+        if (holder == task)
+            throw "Recursive";
+        root->waiting[task] = key;
+        root->ready.wait(guard);
+        root->waiting.erase(task);
+    }
+    root->templates[key].owner = task;
+    guard.unlock();
+
+    std::unique_ptr<UnitParser> unit(new UnitParser(root, def, values, task));
+    try {
+        unit->elaborate();
+    } catch (const char *) {
+        guard.lock();
+        root->templates.erase(key);
+        guard.unlock();
+        root->ready.notify_all();
+        throw;
+    }
+    guard.lock();
+    auto &slot = root->templates[key];
+    slot.unit = std::move(unit);
+    guard.unlock();
+    root->ready.notify_all();
+    return *slot.unit;
+}
+
+// Blocks without parameters used by other blocks, levelled so that a block
+// comes after the ones it instantiates. The blocks of a level are made on
+// the pool, the ones with parameters they use are made on demand.
+void UnitParser::elaborateBlocks()
+{
+    std::map<std::string_view, int> level;
+    std::function<int(std::string_view)> levelOf = [&](std::string_view name) {
+        auto it = level.find(name);
+        if (it != level.end())
+            return it->second;
+        // Cycles stay at -1, the serial elaboration reports them
+        level[name] = -1;
+        int lvl = 0;
+        for (auto use : blocks.find(name)->second.uses) {
+            auto dep = blocks.find(use);
+            if (dep == blocks.end() || !dep->second.params.empty())
+                continue;
+            int sub = levelOf(use);
+            if (sub < 0)
+                return -1;
+            lvl = std::max(lvl, sub + 1);
+        }
+        level[name] = lvl;
+        return lvl;
+    };
+
+    std::vector<std::vector<std::string_view>> levels;
+    for (auto &name : blockOrder) {
+        if (!blocks.find(name)->second.params.empty() || !instantiated.count(name) || templates.count(name))
+            continue;
+        int lvl = levelOf(name);
+        if (lvl < 0)
+            continue;
+        if ((int)levels.size() <= lvl)
+            levels.resize(lvl + 1);
+        levels[lvl].push_back(name);
+    }
+
+    for (auto &names : levels) {
+        std::vector<const char *> errors(names.size(), nullptr);
+        pool->run((int)names.size(), [&](int k) {
+            try {
+                blockTemplate(names[k], {}, k + 1);
+            } catch (const char *err) {
+                errors[k] = err;
+            } catch (const std::bad_alloc &) {
+                errors[k] = "Out of memory";
+            } catch (...) {
+                errors[k] = "Invalid block";
+            }
+        });
+        for (auto err : errors) {
+            if (err != nullptr)
+                throw err;
+        }
+    }
+}
+
+// Block(value, ..., port = vector, ...) binds every input of the block. The
+// first output is the value of the statement, each one is also named
+// <name>_<port>.
+LogicalVector UnitParser::parseInstance(std::string_view &ln, std::string_view block, std::string_view name)
+{
+    expect(ln, '(');
+    std::vector<int> values;
+    std::map<std::string, LogicalVector> ports;
+    while (at(ln) != ')') {
+        if (!values.empty() || !ports.empty())
+            expect(ln, ',');
+        std::string_view from = ln;
+        auto wrd = string_word(ln);
+        if (at(ln) != '=') {
+            if (!ports.empty())
+                throw "Expected '='";
+            ln = from;
+            values.push_back(readNumber(ln));
+            continue;
+        }
+        ln = string_trim(ln.substr(1));
+        std::string_view text;
+        ports[std::string(wrd)] = readCellPin(ln, text);
+    }
+    expect(ln, ')');
+
+    auto &unit = blockTemplate(block, values, task);
+    if (ports.size() != unit.inputs.size())
+        throw "Unbound";
+    for (auto &port : unit.inputs) {
+        if (ports.find(port) == ports.end())
+            throw "Unbound";
+    }
+    if (unit.outputs.empty())
+        throw "Undefined";
+    auto named = builder.addInstance(unit.builder, ports);
+    if (name != "") {
+        for (auto &port : unit.outputs)
+            vectors[symbol(std::string(name) + "_" + port)] = named[port];
+    }
+    return std::move(named[unit.outputs[0]]);
+}
+
+void UnitParser::parseLine(std::string_view ln)
+{
+    try {
+        parseDeclaration(ln);
+    } catch (const char *) {
+        fail(ln);
+        throw;
     }
 }
 
-void UnitParser::parseLine(std::string &ln)
+void UnitParser::parseDeclaration(std::string_view &ln)
 {
     auto name = string_word(ln);
     int pfx = 0;
     if (name == "BLOCK") {
-        name = string_word(ln);
-        parseBlock(name);
+        parseBlock(ln);
         return;
     } else if (name == "IN") {
         pfx = 1;
@@ -296,21 +685,22 @@ void UnitParser::parseLine(std::string &ln)
 
     int size = -1;
     LogicalVector vc;
-    if (ln[0] == '/') {
+    if (at(ln) == '/') {
         ln = ln.substr(1);
-        size = string_number(ln);
+        size = readNumber(ln);
         if (pfx == 1) {
-            vc = builder.addInput(name, size);
+            vc = builder.addInput(std::string(name), size);
+            inputs.emplace_back(name);
         } else
             vc = LogicalVector(size);
-        vectors[name] = vc;
+        vectors[symbol(name)] = vc;
         return; // Should be empty (pfx == 2) Error !!?
     }
 
 
     int idx = 0;
-    if (size == -1 && pfx == 0 && ln[0] == '.') {
-        vc = vectors[name];
+    if (size == -1 && pfx == 0 && at(ln) == '.') {
+        vc = findVector(name);
         if (vc.length == 0)
             throw "Undefined";
 
@@ -320,13 +710,17 @@ void UnitParser::parseLine(std::string &ln)
         pfx = -1;
     }
 
-    if (ln[0] == '=') {
+    if (at(ln) == '=') {
         ln = string_trim(ln.substr(1));
         vc = parseStatement(ln, name);
-    } else if (ln[0] != '#' || ln[0] != '\0') {
+    } else if (at(ln) != '#' || at(ln) != '\0') {
         std::cout << ln << std::endl;
     }
+    assign(pfx, symbol(name), idx, vc);
+}
 
+void UnitParser::assign(int pfx, SymbolId name, int idx, const LogicalVector &vc)
+{
     if (vc.length == 0)
         throw "Undefined";
     if (pfx == 0 || pfx == 2)
@@ -335,16 +729,334 @@ void UnitParser::parseLine(std::string &ln)
         vectors[name].set(idx, vc[0]);
     }
 
-    if (pfx == 2)
-        builder.addInput(name, vc);
+    if (pfx == 2) {
+        builder.addInput(symbols.name(name), vc);
+        outputs.push_back(symbols.name(name));
+    }
+}
+
+// Interned once, the slots of the new symbol are undefined
+SymbolId UnitParser::symbol(std::string_view name)
+{
+    SymbolId id = symbols.insert(name);
+    if (id >= (SymbolId)vectors.size()) {
+        vectors.resize(id + 1);
+        constantes.resize(id + 1, NO_CONSTANT);
+    }
+    return id;
+}
+
+// Vectors read before being declared are empty, reading doesn't add the name
+const LogicalVector &UnitParser::findVector(std::string_view name) const
+{
+    static const LogicalVector empty;
+    SymbolId id = symbols.find(name);
+    return id < 0 ? empty : vectors[id];
+}
+
+int UnitParser::findConstant(SymbolId id) const
+{
+    if (id < 0 || constantes[id] == NO_CONSTANT)
+        throw "Undefined";
+    return constantes[id];
+}
+
+void UnitParser::setConstant(SymbolId id, int value)
+{
+    constantes[id] = value;
+}
+
+// Keep the innermost position, the source is the one of the root parser
+void UnitParser::fail(std::string_view at)
+{
+    std::unique_lock<std::mutex> guard(root->lock);
+    if (root->failedAt == nullptr && root->source->contains(at.data()))
+        root->failedAt = at.data();
+}
+
+std::string UnitParser::where() const
+{
+    if (root->failedAt == nullptr)
+        return "";
+    int line, column;
+    root->source->position(root->failedAt, line, column);
+    return root->source->name() + ":" + std::to_string(line) + ":" + std::to_string(column);
+}
+
+// -=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
+LoopIndex UnitParser::compileIndex(std::string_view &ln)
+{
+    if (std::isdigit(at(ln)))
+        return LoopIndex{ string_number(ln), -1 };
+    auto tx = string_word(ln);
+    SymbolId id = symbols.find(tx);
+    if (id < 0)
+        throw "Undefined";
+    return LoopIndex{ 0, id };
+}
+
+LoopRef UnitParser::compileRef(std::string_view wrd, std::string_view &ln)
+{
+    // Reads don't intern, a name made by a text line is looked up at run
+    LoopRef ref{ symbols.find(wrd), false, LoopIndex{ 0, -1 }, LoopIndex{ 0, -1 }, wrd };
+    if (at(ln) != '.')
+        return ref;
+    ln = ln.substr(1);
+    ref.slice = true;
+    ref.from = compileIndex(ln);
+    ref.to = ref.from;
+    if (at(ln) == '.' && at(ln, 1) == '.') {
+        ln = ln.substr(2);
+        ref.to = compileIndex(ln);
+    }
+    return ref;
+}
+
+void UnitParser::compileLoop(std::vector<LoopLine> &body)
+{
+    for (;;) {
+        auto ln = nextLine();
+        if (ln == "END")
+            break;
+        body.push_back(compileLine(ln));
+    }
 }
 
-std::string UnitParser::nextLine()
+// Same grammar as parseLine() and parseStatement(), the statements which
+// are not declarations, expressions or loops are kept as text
+LoopLine UnitParser::compileLine(std::string_view ln)
 {
-    std::string ln;
-    while (std::getline(rd, ln)) {
+    LoopLine line;
+    line.kind = LoopKind::Text;
+    line.prefix = 0;
+    line.name = -1;
+    line.index = LoopIndex{ 0, -1 };
+    line.carry = -1;
+    line.text = ln;
+    auto keepText = [&](std::string_view wrd) {
+        if (wrd == "BLOCK" || wrd == "LOOP" || wrd == "SELECT") {
+            readSection(line.lines);
+            line.lines.push_back("END");
+        }
+        return std::move(line);
+    };
+
+    auto name = string_word(ln);
+    if (name == "BLOCK")
+        return keepText(name);
+    if (name == "IN" || name == "OUT") {
+        line.prefix = name == "IN" ? 1 : 2;
+        name = string_word(ln);
+    }
+    line.name = symbol(name);
+    if (at(ln) == '/') {
+        ln = ln.substr(1);
+        line.kind = LoopKind::Declare;
+        line.index = compileIndex(ln);
+        return line;
+    }
+    if (line.prefix == 0 && at(ln) == '.') {
+        ln = ln.substr(1);
+        line.index = compileIndex(ln);
+        line.prefix = -1;
+    }
+    if (at(ln) != '=')
+        return keepText("");
+    ln = string_trim(ln.substr(1));
+
+    if (at(ln) == '[') {
+        LoopInstr sum{ GateOpcode::Fix, false, {} };
+        ln = string_trim(ln.substr(1));
+        for (auto wrd = string_word(ln); wrd != ""; wrd = string_word(ln)) {
+            sum.refs.push_back(compileRef(wrd, ln));
+            if (at(ln) == ']')
+                break;
+            else if (at(ln) == ',')
+                ln = string_trim(ln.substr(1));
+        }
+        line.kind = LoopKind::Expression;
+        line.code.push_back(std::move(sum));
+        return line;
+    }
+
+    std::string_view rest = ln;
+    auto wrd = string_word(rest);
+    if (wrd == "LOOP") {
+        if (at(rest) != '(')
+            throw "Expected '('";
+        rest = string_trim(rest.substr(1));
+        line.index = compileIndex(rest);
+        if (at(rest) != ')')
+            throw "Expected ')'";
+        rest = string_trim(rest.substr(1));
+        line.carry = symbol(string_word(rest));
+        line.kind = LoopKind::Loop;
+        compileLoop(line.body);
+        return line;
+    }
+    if (wrd == "SELECT" || wrd == "ONE" || wrd == "ZERO" || wrd == "REG" || wrd == "RAM" || wrd == "ROM"
+        || ((wrd == "ADD" || wrd == "SHIFT" || wrd == "CMP") && at(rest) == '(')
+        || (at(rest) == '(' && findBlock(wrd)))
+        return keepText(wrd);
+
+    Expression<LoopNode> expr;
+    for (wrd = string_word(ln); wrd != ""; wrd = string_word(ln)) {
+        auto op = GateOpcode::Fix;
+        if (wrd == "XOR")
+            op = GateOpcode::Xor;
+        else if (wrd == "AND")
+            op = GateOpcode::And;
+        else if (wrd == "OR")
+            op = GateOpcode::Or;
+        else if (wrd == "NAND")
+            op = GateOpcode::Nand;
+        else if (wrd == "NOR")
+            op = GateOpcode::Nor;
+        else if (wrd == "NOT")
+            op = GateOpcode::Not;
+
+        if (op != GateOpcode::Fix && at(ln) != '[') {
+            expr.addOperator(LoopNode(op, &line.code));
+            continue;
+        }
+        LoopInstr push{ op, op != GateOpcode::Fix, {} };
+        if (push.reduce) {
+            ln = string_trim(ln.substr(1));
+            for (auto sub = string_word(ln); sub != ""; sub = string_word(ln)) {
+                push.refs.push_back(compileRef(sub, ln));
+                if (at(ln) == ']')
+                    break;
+                else if (at(ln) == ',')
+                    ln = string_trim(ln.substr(1));
+            }
+        } else {
+            push.refs.push_back(compileRef(wrd, ln));
+        }
+        line.code.push_back(std::move(push));
+        expr.addOperand(LoopNode(GateOpcode::Fix, &line.code));
+    }
+    expr.compile();
+    line.kind = LoopKind::Expression;
+    return line;
+}
+
+int UnitParser::indexValue(const LoopIndex &index) const
+{
+    if (index.constant < 0)
+        return index.value;
+    return findConstant(index.constant);
+}
+
+LogicalVector UnitParser::refValue(const LoopRef &ref)
+{
+    SymbolId id = ref.name >= 0 ? ref.name : symbols.find(ref.text);
+    if (id < 0)
+        throw "Undefined";
+    const LogicalVector &vc = vectors[id];
+    if (!ref.slice)
+        return vc;
+    return vc.sub(indexValue(ref.from), indexValue(ref.to));
+}
+
+void UnitParser::runLine(const LoopLine &line)
+{
+    if (line.kind == LoopKind::Text) {
+        // Its lines are read instead of the current source
+        auto lines = body;
+        auto next = cursor;
+        body = &line.lines;
+        cursor = 0;
+        try {
+            parseLine(line.text);
+        } catch (...) {
+            body = lines;
+            cursor = next;
+            throw;
+        }
+        body = lines;
+        cursor = next;
+        return;
+    }
+
+    try {
+        runStatement(line);
+    } catch (const char *) {
+        fail(line.text);
+        throw;
+    }
+}
+
+void UnitParser::runStatement(const LoopLine &line)
+{
+    int idx = indexValue(line.index);
+    if (line.kind == LoopKind::Declare) {
+        if (line.prefix == 1) {
+            vectors[line.name] = builder.addInput(symbols.name(line.name), idx);
+            inputs.push_back(symbols.name(line.name));
+        } else
+            vectors[line.name] = LogicalVector(idx);
+        return;
+    }
+    if (line.prefix == -1 && vectors[line.name].length == 0)
+        throw "Undefined";
+
+    LogicalVector vc;
+    if (line.kind == LoopKind::Loop) {
+        vc = runLoop(line.body, idx, line.carry, line.name);
+    } else {
+        std::vector<LogicalVector> stack;
+        for (auto &in : line.code) {
+            if (in.opcode == GateOpcode::Fix || in.reduce) {
+                LogicalVector sum;
+                if (in.refs.size() == 1)
+                    sum = refValue(in.refs[0]);
+                else {
+                    for (auto &ref : in.refs)
+                        sum += refValue(ref);
+                }
+                if (in.reduce)
+                    sum = LogicalVector(builder.addGateSum(in.opcode, sum), 1);
+                stack.push_back(std::move(sum));
+            } else if (in.opcode == GateOpcode::Not) {
+                stack.back() = builder.addGate(in.opcode, stack.back());
+            } else {
+                auto rhs = std::move(stack.back());
+                stack.pop_back();
+                stack.back() = builder.addGate(in.opcode, stack.back(), rhs);
+            }
+        }
+        vc = std::move(stack.back());
+    }
+    assign(line.prefix, line.name, idx, vc);
+}
+
+// Next raw line of the file or of the block being elaborated
+bool UnitParser::readLine(std::string_view &ln)
+{
+    if (body == nullptr) {
+        auto text = source->text();
+        if (offset >= text.size())
+            return false;
+        auto end = text.find('\n', offset);
+        if (end == std::string_view::npos)
+            end = text.size();
+        ln = text.substr(offset, end - offset);
+        offset = end + 1;
+        return true;
+    }
+    if (cursor >= body->size())
+        return false;
+    ln = (*body)[cursor++];
+    return true;
+}
+
+std::string_view UnitParser::nextLine()
+{
+    std::string_view ln;
+    while (readLine(ln)) {
         ln = string_trim(ln);
-        if (ln[0] == '\0' || ln[0] == '#')
+        if (at(ln) == '\0' || at(ln) == '#')
             continue;
         return ln;
     }
@@ -352,16 +1064,50 @@ std::string UnitParser::nextLine()
     throw "End of file";
 }
 
-void UnitParser::parse()
+void UnitParser::elaborate()
 {
-    std::string ln;
-    while (std::getline(rd, ln)) {
-        ln = string_trim(ln);
-        if (ln[0] == '\0' || ln[0] == '#')
-            continue;
-        parseLine(ln);
+    std::string_view ln;
+    auto parseAll = [&]() {
+        while (readLine(ln)) {
+            ln = string_trim(ln);
+            if (at(ln) == '\0' || at(ln) == '#')
+                continue;
+            parseLine(ln);
+        }
+    };
+    parseAll();
+    if (root == this) {
+        if (pool != nullptr)
+            elaborateBlocks();
+        for (size_t k = 0; k < blockOrder.size(); ++k) {
+            auto &def = blocks.find(blockOrder[k])->second;
+            if (!def.params.empty() || instantiated.count(blockOrder[k]))
+                continue;
+            body = &def.lines;
+            cursor = 0;
+            parseAll();
+            body = nullptr;
+        }
+    }
+    bindPending();
+}
+
+void UnitParser::elaborateParallel(ThreadPool &workers)
+{
+    pool = &workers;
+    try {
+        elaborate();
+    } catch (const char *) {
+        pool = nullptr;
+        throw;
     }
+    pool = nullptr;
+}
 
+void UnitParser::parse()
+{
+    elaborate();
+    std::cout << "GATES (" << builder.count() << ", " << (builder.memoryPeak() + 1023) / 1024 << " KiB peak)" << std::endl;
     builder.tick();
     builder.dump();
     builder.dump2();
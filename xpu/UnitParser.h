@@ -1,32 +1,178 @@
 #pragma once
+#include <condition_variable>
 #include <iostream>
-#include <fstream>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <string_view>
+#include <vector>
 #include "UnitBuilder.h"
+#include "SourceFile.h"
+#include "SymbolTable.h"
+#include "ThreadPool.h"
+
+// Macro cell pin read before all its entries were set, the text is read
+// again at the end of the file
+struct PendingPin
+{
+    int cell;
+    std::string pin;
+    std::string_view text;
+};
+
+// BLOCK text kept to be elaborated once per set of parameters
+struct BlockDef
+{
+    std::vector<std::string> params;
+    std::vector<std::string_view> lines;
+    // Names read as Name(...), the blocks it may instantiate
+    std::vector<std::string_view> uses;
+};
+
+// Bound or bit index of a compiled line, a literal or a constant read
+// each time the line runs
+struct LoopIndex
+{
+    int value;
+    SymbolId constant; // -1 for a literal
+};
+
+// Vector read by a compiled line, name or name.from[..to]
+struct LoopRef
+{
+    SymbolId name; // -1 until a line run before defines it
+    bool slice;
+    LoopIndex from;
+    LoopIndex to;
+    std::string_view text;
+};
+
+// Stack machine step: Fix pushes the refs put end to end, reduce folds
+// them with addGateSum, other opcodes apply to the top entries
+struct LoopInstr
+{
+    GateOpcode opcode;
+    bool reduce;
+    std::vector<LoopRef> refs;
+};
+
+enum class LoopKind
+{
+    Declare, // name/size
+    Expression,
+    Loop,
+    Text,    // Parsed again each time, with its lines up to END
+};
+
+// Line of a LOOP body parsed once and run for every value of i
+struct LoopLine
+{
+    LoopKind kind;
+    int prefix; // IN 1, OUT 2, bit assignment -1
+    SymbolId name;
+    LoopIndex index; // Size, bit assigned or loop count
+    std::vector<LoopInstr> code;
+    SymbolId carry;
+    std::vector<LoopLine> body;
+    std::string_view text;
+    std::vector<std::string_view> lines;
+};
+
+class UnitParser;
+
+// Template being elaborated while unit is null, owner is the task doing it
+struct BlockTemplate
+{
+    std::unique_ptr<UnitParser> unit;
+    int owner;
+};
 
 class UnitParser
 {
 private:
-    std::ifstream rd;
+    std::unique_ptr<SourceFile> source;
+    size_t offset;
+    std::string folder;
+    // Lines of a block template, read instead of the file when set
+    const std::vector<std::string_view> *body;
+    size_t cursor;
+    // Definitions and templates are shared by all the parsers of a file,
+    // lock guards them while blocks are elaborated in parallel
+    UnitParser *root;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::map<std::string, BlockDef, std::less<>> blocks;
+    std::vector<std::string> blockOrder;
+    std::set<std::string, std::less<>> instantiated;
+    std::map<std::string, BlockTemplate> templates;
+    // Template key each task is waiting for
+    std::map<int, std::string> waiting;
+    ThreadPool *pool;
+    // Pool task elaborating this parser, 0 on the calling thread
+    int task;
+    std::vector<std::string> inputs;
+    std::vector<std::string> outputs;
+    std::vector<PendingPin> pending;
     UnitBuilder builder;
-    std::map<std::string, LogicalVector> vectors;
-    std::map<std::string, int> constantes;
+    // Vector and constant of each symbol, indexed by SymbolId
+    SymbolTable symbols;
+    std::vector<LogicalVector> vectors;
+    std::vector<int> constantes;
+    SymbolId loopIndex;
+    // Where the first error was caught, in the source of the root parser
+    const char *failedAt;
+
+    UnitParser(UnitParser *root, const BlockDef &def, const std::vector<int> &values, int task);
+    bool readLine(std::string_view &ln);
+    void readSection(std::vector<std::string_view> &lines, std::vector<std::string_view> *uses = nullptr);
+    const BlockDef *findBlock(std::string_view name);
+    void fail(std::string_view at);
+    SymbolId symbol(std::string_view name);
+    const LogicalVector &findVector(std::string_view name) const;
+    int findConstant(SymbolId id) const;
+    void setConstant(SymbolId id, int value);
+    void assign(int pfx, SymbolId name, int idx, const LogicalVector &vc);
+    LoopIndex compileIndex(std::string_view &ln);
+    LoopRef compileRef(std::string_view wrd, std::string_view &ln);
+    void compileLoop(std::vector<LoopLine> &body);
+    LoopLine compileLine(std::string_view ln);
+    int indexValue(const LoopIndex &index) const;
+    LogicalVector refValue(const LoopRef &ref);
+    LogicalVector runLoop(const std::vector<LoopLine> &body, int loop, SymbolId carry, SymbolId result);
+    void runLine(const LoopLine &line);
+    void runStatement(const LoopLine &line);
+    UnitParser &blockTemplate(std::string_view name, const std::vector<int> &values, int task);
+    void elaborateBlocks();
 public:
     UnitParser(const std::string &path);
-    LogicalVector parseLoop(int loop, const std::string &name, const std::string &name2);
+    LogicalVector parseLoop(int loop, std::string_view name, std::string_view name2);
     LogicalVector parseSelect(LogicalVector vc);
-    LogicalVector parseLoopEntry(std::string &ln, const std::string &name);
-    LogicalVector parseSelectEntry(std::string &ln);
-    LogicalVector parseVecEntry(std::string &ln, GateOpcode op);
-    LogicalVector readVectors(std::string &ln);
-    LogicalVector readVector(const std::string &wrd, std::string &ln);
-    LogicalVector parseStatement(std::string &ln, const std::string &name);
-
-    int readNumber(std::string &str);
-    void parseBlock(const std::string &name);
-
-    void parseLine(std::string &ln);
-    std::string nextLine();
+    LogicalVector parseLoopEntry(std::string_view &ln, std::string_view name);
+    LogicalVector parseSelectEntry(std::string_view &ln);
+    LogicalVector parseVecEntry(std::string_view &ln, GateOpcode op);
+    LogicalVector parseCellEntry(std::string_view &ln, GateOpcode op);
+    LogicalVector parseArithEntry(std::string_view &ln, std::string_view op, std::string_view name);
+    LogicalVector readCellPin(std::string_view &ln, std::string_view &text);
+    void bindPending();
+    LogicalVector readVectors(std::string_view &ln);
+    LogicalVector readVector(std::string_view wrd, std::string_view &ln);
+    LogicalVector parseStatement(std::string_view &ln, std::string_view name);
+
+    int readNumber(std::string_view &str);
+    void parseBlock(std::string_view &ln);
+    LogicalVector parseInstance(std::string_view &ln, std::string_view block, std::string_view name);
+
+    void parseLine(std::string_view ln);
+    void parseDeclaration(std::string_view &ln);
+    std::string_view nextLine();
+    void elaborate();
+    // Same board, the blocks instantiated by others are elaborated on the
+    // pool first, those which don't depend on each other concurrently
+    void elaborateParallel(ThreadPool &pool);
+    // file:line:column of the first error, empty if unknown
+    std::string where() const;
     void parse();
+    UnitBuilder &unit() { return builder; }
 };